@@ -0,0 +1,82 @@
+/*
+Copyright (C) 2017 by Azat Khasanshin <azat.khasanshin@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "browser/blit.hpp"
+
+/* times copying a whole BGRA frame the way OnPaint does, row by row with
+ * memcpy against blit_rows and the BlitPool, at the usual canvas sizes.
+ * The destination pitch is padded like the shared frame slots. */
+namespace
+{
+const int ROUNDS = 200;
+
+double time_copy(const std::function<void()>& copy)
+{
+	copy(); // fault everything in first
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ROUNDS; i++)
+		copy();
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / ROUNDS;
+}
+
+void report(const char* name, size_t bytes, double ms)
+{
+	std::printf("  %-8s %8.3f ms %8.2f GB/s\n", name, ms, bytes / (ms * 1e6));
+}
+} // namespace
+
+int main()
+{
+	const struct {
+		size_t width;
+		size_t height;
+	} sizes[] = {{1280, 720}, {1920, 1080}, {3840, 2160}};
+	BlitPool pool;
+
+	for (const auto& size : sizes) {
+		size_t row_bytes = size.width * 4;
+		size_t dst_pitch = (row_bytes + 63) & ~size_t(63);
+		std::vector<uint8_t> src(row_bytes * size.height, 0x5a);
+		std::vector<uint8_t> dst(dst_pitch * size.height);
+		size_t bytes = row_bytes * size.height;
+
+		auto rows = [&] {
+			for (size_t y = 0; y < size.height; y++)
+				std::memcpy(&dst[y * dst_pitch], &src[y * row_bytes], row_bytes);
+		};
+		auto blit = [&] {
+			blit_rows(dst.data(), dst_pitch, src.data(), row_bytes, row_bytes,
+			          size.height);
+		};
+		auto pooled = [&] {
+			pool.Blit(dst.data(), dst_pitch, src.data(), row_bytes, row_bytes,
+			          size.height);
+		};
+
+		std::printf("%zux%zu\n", size.width, size.height);
+		report("memcpy", bytes, time_copy(rows));
+		report("blit", bytes, time_copy(blit));
+		report("pool", bytes, time_copy(pooled));
+	}
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+Copyright (C) 2017 by Azat Khasanshin <azat.khasanshin@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* times starting a trivial program with fork and exec, as the plugin used
+ * to, against posix_spawn, which launch_browser uses now. Only the time the
+ * parent is held up counts, the child running and being waited for does
+ * not. fork copies the page tables of the whole process, so the first
+ * argument gives the size in MiB of a heap to touch beforehand, to get
+ * closer to a running OBS. */
+
+#define ROUNDS 200
+
+extern char** environ;
+
+static char* const child_argv[] = {"/bin/true", NULL};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int run_fork(void)
+{
+	int pid = fork();
+	if (pid == 0) {
+		execve(child_argv[0], child_argv, environ);
+		_exit(127);
+	}
+	return pid;
+}
+
+static int run_spawn(void)
+{
+	pid_t pid;
+	if (posix_spawn(&pid, child_argv[0], NULL, NULL, child_argv, environ) != 0)
+		return -1;
+	return pid;
+}
+
+/* average time until start returns in the parent, in microseconds */
+static double time_start(int (*start)(void))
+{
+	uint64_t total = 0;
+	for (int i = 0; i < ROUNDS; i++) {
+		uint64_t begin = now_ns();
+		int pid = start();
+		total += now_ns() - begin;
+		if (pid <= 0) {
+			perror("starting the child failed");
+			exit(1);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	return total / 1000.0 / ROUNDS;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t heap_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+	char* heap = NULL;
+	if (heap_mb > 0) {
+		heap = malloc(heap_mb << 20);
+		if (!heap) {
+			perror("allocating the heap failed");
+			return 1;
+		}
+		memset(heap, 1, heap_mb << 20);
+	}
+
+	printf("heap %zu MiB\n", heap_mb);
+	printf("  fork+exec   %8.1f us\n", time_start(run_fork));
+	printf("  posix_spawn %8.1f us\n", time_start(run_spawn));
+
+	free(heap);
+	return 0;
+}
@@ -0,0 +1,224 @@
+/*
+Copyright (C) 2017 by Azat Khasanshin <azat.khasanshin@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "blit.hpp"
+
+namespace
+{
+// below this the copy most likely still fits in the cache and plain memcpy
+// is as fast, above it streaming stores avoid the read for ownership and
+// keep CEF's working set cached
+const size_t STREAM_THRESHOLD = 512 * 1024;
+// a band has to be at least this big to be worth waking a thread for, which
+// keeps anything up to about 720p on the calling thread
+const size_t MIN_BAND_BYTES = 4 * 1024 * 1024;
+// copying is bound by memory bandwidth, a handful of threads saturate it
+const size_t MAX_BLIT_THREADS = 3;
+
+typedef void (*row_kernel)(uint8_t* dst, const uint8_t* src, size_t bytes);
+
+#if defined(__SSE2__)
+void stream_row_sse2(uint8_t* dst, const uint8_t* src, size_t bytes)
+{
+	size_t head = std::min(size_t(-reinterpret_cast<uintptr_t>(dst) & 15), bytes);
+	std::memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	bytes -= head;
+
+	for (; bytes >= 64; bytes -= 64, dst += 64, src += 64) {
+		const __m128i* s = reinterpret_cast<const __m128i*>(src);
+		__m128i a = _mm_loadu_si128(s);
+		__m128i b = _mm_loadu_si128(s + 1);
+		__m128i c = _mm_loadu_si128(s + 2);
+		__m128i d = _mm_loadu_si128(s + 3);
+		__m128i* t = reinterpret_cast<__m128i*>(dst);
+		_mm_stream_si128(t, a);
+		_mm_stream_si128(t + 1, b);
+		_mm_stream_si128(t + 2, c);
+		_mm_stream_si128(t + 3, d);
+	}
+	for (; bytes >= 16; bytes -= 16, dst += 16, src += 16)
+		_mm_stream_si128(reinterpret_cast<__m128i*>(dst),
+		                 _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+	std::memcpy(dst, src, bytes);
+}
+#endif
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) void stream_row_avx2(uint8_t* dst, const uint8_t* src,
+                                                     size_t bytes)
+{
+	size_t head = std::min(size_t(-reinterpret_cast<uintptr_t>(dst) & 31), bytes);
+	std::memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	bytes -= head;
+
+	for (; bytes >= 128; bytes -= 128, dst += 128, src += 128) {
+		const __m256i* s = reinterpret_cast<const __m256i*>(src);
+		__m256i a = _mm256_loadu_si256(s);
+		__m256i b = _mm256_loadu_si256(s + 1);
+		__m256i c = _mm256_loadu_si256(s + 2);
+		__m256i d = _mm256_loadu_si256(s + 3);
+		__m256i* t = reinterpret_cast<__m256i*>(dst);
+		_mm256_stream_si256(t, a);
+		_mm256_stream_si256(t + 1, b);
+		_mm256_stream_si256(t + 2, c);
+		_mm256_stream_si256(t + 3, d);
+	}
+	for (; bytes >= 32; bytes -= 32, dst += 32, src += 32)
+		_mm256_stream_si256(reinterpret_cast<__m256i*>(dst),
+		                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)));
+	std::memcpy(dst, src, bytes);
+}
+#endif
+
+row_kernel pick_stream_kernel()
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return stream_row_avx2;
+#endif
+#if defined(__SSE2__)
+	return stream_row_sse2;
+#else
+	return nullptr;
+#endif
+}
+} // namespace
+
+void blit_rows(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch,
+               size_t row_bytes, size_t rows)
+{
+	static const row_kernel stream_row = pick_stream_kernel();
+
+	if (!stream_row || row_bytes * rows < STREAM_THRESHOLD) {
+		if (dst_pitch == row_bytes && src_pitch == row_bytes) {
+			std::memcpy(dst, src, row_bytes * rows);
+			return;
+		}
+		for (size_t y = 0; y < rows; y++)
+			std::memcpy(dst + y * dst_pitch, src + y * src_pitch, row_bytes);
+		return;
+	}
+
+	for (size_t y = 0; y < rows; y++)
+		stream_row(dst + y * dst_pitch, src + y * src_pitch, row_bytes);
+#if defined(__SSE2__)
+	// streaming stores are weakly ordered, make them visible before the
+	// frame gets published
+	_mm_sfence();
+#endif
+}
+
+BlitPool::BlitPool()
+{
+	size_t cores = std::thread::hardware_concurrency();
+	maxThreads = cores > 1 ? std::min(cores - 1, MAX_BLIT_THREADS) : 0;
+}
+
+BlitPool::~BlitPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+void BlitPool::Start()
+{
+	for (size_t i = 0; i < maxThreads; i++)
+		threads.emplace_back([this] { this->Worker(); });
+}
+
+void BlitPool::Blit(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch,
+                    size_t row_bytes, size_t rows)
+{
+	size_t bands = std::min(row_bytes * rows / MIN_BAND_BYTES, maxThreads + 1);
+	bands = std::min(bands, rows);
+	if (bands < 2) {
+		blit_rows(dst, dst_pitch, src, src_pitch, row_bytes, rows);
+		return;
+	}
+	if (threads.empty())
+		Start();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = {dst, dst_pitch, src, src_pitch, row_bytes, rows, bands};
+		nextBand = 0;
+		bandsDone = 0;
+		jobGeneration++;
+	}
+	wake.notify_all();
+
+	while (CopyBand())
+		;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return bandsDone == job.bands; });
+}
+
+/* copies the next unclaimed band of the current job, returns false once all
+ * of them are claimed */
+bool BlitPool::CopyBand()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (nextBand >= job.bands)
+		return false;
+	size_t band = nextBand++;
+	Job current = job;
+	lock.unlock();
+
+	size_t first = current.rows * band / current.bands;
+	size_t last = current.rows * (band + 1) / current.bands;
+	blit_rows(current.dst + first * current.dst_pitch, current.dst_pitch,
+	          current.src + first * current.src_pitch, current.src_pitch, current.row_bytes,
+	          last - first);
+
+	lock.lock();
+	if (++bandsDone == current.bands)
+		done.notify_one();
+	return true;
+}
+
+void BlitPool::Worker()
+{
+	uint64_t seen = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || jobGeneration != seen; });
+			if (stopping)
+				return;
+			seen = jobGeneration;
+		}
+		while (CopyBand())
+			;
+	}
+}
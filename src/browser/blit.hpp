@@ -0,0 +1,73 @@
+/*
+Copyright (C) 2017 by Azat Khasanshin <azat.khasanshin@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// copies rows rows of row_bytes each between buffers of different pitch.
+// Big copies are written with non-temporal stores so that a 4K frame does not
+// evict everything CEF touches next; they are fenced before returning, so the
+// destination can be published right away.
+void blit_rows(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch,
+               size_t row_bytes, size_t rows);
+
+// splits big blits into horizontal bands copied in parallel by a few worker
+// threads and the caller. The workers are only started once the first copy
+// large enough to be split comes along.
+class BlitPool {
+public:
+	BlitPool();
+	~BlitPool();
+
+	BlitPool(const BlitPool&) = delete;
+	BlitPool& operator=(const BlitPool&) = delete;
+
+	// same as blit_rows, returns once every band is copied
+	void Blit(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch,
+	          size_t row_bytes, size_t rows);
+
+private:
+	void Start();
+	void Worker();
+	bool CopyBand();
+
+	struct Job {
+		uint8_t* dst;
+		size_t dst_pitch;
+		const uint8_t* src;
+		size_t src_pitch;
+		size_t row_bytes;
+		size_t rows;
+		size_t bands;
+	};
+
+	std::vector<std::thread> threads;
+	size_t maxThreads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	Job job;
+	uint64_t jobGeneration{0};
+	size_t nextBand{0};
+	size_t bandsDone{0};
+	bool stopping{false};
+};
@@ -16,64 +16,97 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <fcntl.h>
-#include <signal.h>
+#include <poll.h>
 #include <sys/inotify.h>
-#include <sys/mman.h>
-#include <sys/msg.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
-#include <unordered_map>
+#include <thread>
+
+#include <cef_task.h>
 
 #include "browser-app.hpp"
 #include "config.h"
 
-/* for signal handling */
 namespace
 {
-int static_in_fd{0};
-BrowserApp* ba{nullptr};
-void file_changed(int signum)
-{
-	inotify_event event;
+class FunctionTask : public CefTask {
+public:
+	FunctionTask(std::function<void()> function) : function(function) {}
 
-	if (static_in_fd != 0 && ba != nullptr) {
-		read(static_in_fd, (void*) &event, sizeof(inotify_event));
-		ba->ReloadPage();
+	void Execute() override
+	{
+		function();
 	}
-}
 
-bool beginsWith(const std::string& base, const std::string& beginning)
+private:
+	std::function<void()> function;
+
+	IMPLEMENT_REFCOUNTING(FunctionTask);
+};
+
+/* receive the file descriptors the plugin sent over the socketpair together
+ * with size bytes of payload, returns how many came along or -1 once the
+ * plugin closed its end */
+ssize_t receive_fds(int sock, void* payload, size_t size, int* fds, size_t max)
 {
-	return base.substr(0, beginning.size()) == beginning;
+	struct iovec iov = {payload, size};
+	char control[CMSG_SPACE(sizeof(int) * SHARED_IPC_MAX_FDS)];
+
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (received <= 0)
+		return -1;
+	if (received != ssize_t(size))
+		return 0;
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return 0;
+
+	size_t count = std::min((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), max);
+	std::memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+	return count;
 }
 } // namespace
 
-BrowserApp::BrowserApp(char* shmname)
+BrowserApp::BrowserApp(int ipc_fd, std::string cacheDir, std::string cacheName)
 {
-	if (shmname != nullptr && beginsWith({shmname}, {SHM_NAME})) {
-		shm_name = shmname;
-
-		// init inotify
-		in_fd = inotify_init1(IN_NONBLOCK);
-		fcntl(in_fd, F_SETFL, O_ASYNC);
-		fcntl(in_fd, F_SETOWN, getpid());
-		struct sigaction action;
-		std::memset(&action, 0, sizeof(struct sigaction));
-		action.sa_handler = file_changed;
-		sigaction(SIGIO, &action, nullptr);
-		static_in_fd = in_fd;
-		ba = this;
-
-		InitSharedData();
-	}
+	if (ipc_fd < 0)
+		return;
+
+	this->ipc_fd = ipc_fd;
+	this->cacheDir = cacheDir;
+	this->cacheName = cacheName;
+	// the socket must not leak into the CEF subprocesses
+	fcntl(ipc_fd, F_SETFD, FD_CLOEXEC);
+	in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+/* the first source comes along with the process, it tells whether this is
+ * the shared host before CEF is set up. Not done in the constructor, the
+ * references ReceiveAttach takes would free the app again while nobody
+ * holds one yet. */
+void BrowserApp::ReceiveFirstAttach()
+{
+	if (ipc_fd >= 0)
+		ReceiveAttach();
 }
 
 BrowserApp::~BrowserApp()
 {
-	UninitSharedData();
-	if (in_fd)
+	if (in_fd >= 0)
 		close(in_fd);
 }
 
@@ -81,242 +114,167 @@ void BrowserApp::OnBeforeCommandLineProcessing(const CefString& processType,
                                                CefRefPtr<CefCommandLine> commandLine)
 {
 	commandLine->AppendSwitchWithValue("autoplay-policy", "no-user-gesture-required");
+	// a crashing page must not take the other sources' pages with it
+	if (host)
+		commandLine->AppendSwitch("process-per-tab");
 }
 
-// Open shared memory and read initial data
-void BrowserApp::InitSharedData()
+/* handle the next message on the socket, see shared_attach_t. Nothing but
+ * the version is checked for SHARED_IDLE. Returns false once the plugin closed
+ * its end. */
+bool BrowserApp::ReceiveAttach()
 {
-	fd = shm_open(shm_name.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
-	if (fd == -1) {
-		std::cerr << "Browser: shared memory open failed\n";
-		return;
-	}
-	data = reinterpret_cast<shared_data*>(
-	    mmap(nullptr, sizeof(shared_data), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
-
-	if (data == MAP_FAILED) {
-		std::cerr << "Browser: data mapping failed\n";
-		return;
-	}
+	int fds[SHARED_IPC_MAX_FDS];
+	shared_attach_t attach = {};
+	ssize_t count = receive_fds(ipc_fd, &attach, sizeof(attach), fds, SHARED_IPC_MAX_FDS);
+	if (count < 0)
+		return false;
 
-	pthread_mutex_lock(&data->mutex);
-	qid = data->qid;
-	width = data->width;
-	height = data->height;
-	fps = data->fps;
-	pthread_mutex_unlock(&data->mutex);
-
-	data = reinterpret_cast<shared_data*>(mmap(nullptr, sizeof(shared_data) + MAX_DATA_SIZE,
-	                                           PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
-	if (data == MAP_FAILED) {
-		std::cerr << "Browser: data remapping failed\n";
-		return;
+	if (attach.version != BROWSER_PROTOCOL_VERSION) {
+		std::cerr << "Browser: plugin speaks protocol version " << attach.version
+		          << ", expected " << BROWSER_PROTOCOL_VERSION << "\n";
+		std::exit(BROWSER_EXIT_PROTOCOL);
 	}
-}
-
-void BrowserApp::UninitSharedData()
-{
-	if (data && data != MAP_FAILED) {
-		munmap(data, sizeof(shared_data) + MAX_DATA_SIZE);
+	host = attach.flags & SHARED_ATTACH_HOST;
+
+	CefRefPtr<BrowserApp> app{this};
+	uint32_t id = attach.id;
+	if (attach.op == SHARED_ATTACH) {
+		if (count != SHARED_IPC_MAX_FDS) {
+			std::cerr << "Browser: receiving shared memory failed\n";
+			for (ssize_t i = 0; i < count; i++)
+				close(fds[i]);
+			return true;
+		}
+		CefRefPtr<BrowserInstance> instance{new BrowserInstance(id, fds, *this)};
+		if (!instance->IsValid())
+			return true;
+		if (!initialized)
+			first = instance;
+		else
+			CefPostTask(TID_UI, new FunctionTask([app, instance] {
+				            app->AddInstance(instance);
+			            }));
+	} else if (attach.op == SHARED_DETACH) {
+		CefPostTask(TID_UI, new FunctionTask([app, id] { app->DetachInstance(id); }));
 	}
+	return true;
 }
 
-// Message receiver loop
-void BrowserApp::MessageThreadWorker()
+/* waits for sources to attach and detach and for watched files to change */
+void BrowserApp::AttachThreadWorker()
 {
-	std::unordered_map<uint8_t, SplitMessage*> splitMessages;
-	size_t max_buf_size = MAX_MESSAGE_SIZE;
-	ssize_t received;
-	CefMouseEvent e;
-	CefKeyEvent ke;
-
-	browser_message_t msg;
+	struct pollfd fds[] = {{ipc_fd, POLLIN, 0}, {in_fd, POLLIN, 0}};
+	CefRefPtr<BrowserApp> app{this};
 
 	while (true) {
-		received = msgrcv(this->GetQueueId(), &msg, max_buf_size, 0, MSG_NOERROR);
-		if (received != -1) {
-			switch (msg.generic.type) {
-			case MESSAGE_TYPE_URL:
-				this->UrlChanged(msg.text.text);
-				break;
-			case MESSAGE_TYPE_URL_LONG:
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
 
-				if (splitMessages.count(msg.split_text.id) <= 0) {
-					splitMessages.insert(
-					    {msg.split_text.id,
-					     new SplitMessage(msg.split_text.id,
-					                      msg.split_text.max)});
+		if (fds[1].revents & POLLIN) {
+			alignas(inotify_event) char buf[4096];
+			ssize_t len;
+			while ((len = read(in_fd, buf, sizeof(buf))) > 0) {
+				const char* pos = buf;
+				while (pos < buf + len) {
+					const inotify_event* event =
+					    reinterpret_cast<const inotify_event*>(pos);
+					int wd = event->wd;
+					CefPostTask(TID_UI, new FunctionTask([app, wd] {
+						            app->ReloadWatched(wd);
+					            }));
+					pos += sizeof(inotify_event) + event->len;
 				}
+			}
+		}
 
-				splitMessages.at(msg.split_text.id)->addMessage(msg);
-
-				if (splitMessages.at(msg.split_text.id)->dataIsReady()) {
-					this->UrlChanged(
-					    splitMessages.at(msg.split_text.id)->getData());
-					delete splitMessages.at(msg.split_text.id);
-					splitMessages.erase(msg.split_text.id);
-				}
-				break;
-			case MESSAGE_TYPE_SIZE:
-				this->SizeChanged();
-				break;
-			case MESSAGE_TYPE_RELOAD:
-				this->ReloadPage();
-				break;
-			case MESSAGE_TYPE_CSS:
-				this->CssChanged(msg.text.text);
-				break;
-			case MESSAGE_TYPE_JS:
-				this->JsChanged(msg.text.text);
-				break;
-			case MESSAGE_TYPE_MOUSE_CLICK:
-				e.modifiers = msg.mouse_click.modifiers;
-				e.x = msg.mouse_click.x;
-				e.y = msg.mouse_click.y;
-				this->GetBrowser()->GetHost()->SendMouseClickEvent(
-				    e,
-				    static_cast<CefBrowserHost::MouseButtonType>(
-				        msg.mouse_click.button_type),
-				    msg.mouse_click.mouse_up, msg.mouse_click.click_count);
-				break;
-			case MESSAGE_TYPE_MOUSE_MOVE:
-				e.modifiers = msg.mouse_move.modifiers;
-				e.x = msg.mouse_move.x;
-				e.y = msg.mouse_move.y;
-				this->GetBrowser()->GetHost()->SendMouseMoveEvent(
-				    e, msg.mouse_move.mouse_leave);
-				break;
-			case MESSAGE_TYPE_MOUSE_WHEEL:
-				e.modifiers = msg.mouse_wheel.modifiers;
-				e.x = msg.mouse_wheel.x;
-				e.y = msg.mouse_wheel.y;
-				this->GetBrowser()->GetHost()->SendMouseWheelEvent(
-				    e, msg.mouse_wheel.x_delta, msg.mouse_wheel.y_delta);
-				break;
-			case MESSAGE_TYPE_FOCUS:
-				this->GetBrowser()->GetHost()->SendFocusEvent(msg.focus.focus);
-				break;
-			case MESSAGE_TYPE_KEY:
-				/* I have no idea what is happening */
-				ke.windows_key_code = msg.key.native_vkey;
-				ke.native_key_code = msg.key.native_vkey;
-				ke.modifiers = msg.key.modifiers;
-				ke.type = msg.key.key_up ? KEYEVENT_KEYUP : KEYEVENT_RAWKEYDOWN;
-				if (msg.key.chr != 0) {
-					ke.character = msg.key.chr;
-					if (!msg.key.key_up)
-						ke.type = KEYEVENT_CHAR;
-				}
-				this->GetBrowser()->GetHost()->SendKeyEvent(ke);
-				break;
-			case MESSAGE_TYPE_SCROLLBARS:
-				this->GetClient()->SetScrollbars(this->GetBrowser(),
-				                                 msg.generic_state.state);
-				break;
-			case MESSAGE_TYPE_ZOOM:
-				this->GetClient()->SetZoom(this->GetBrowser(), msg.zoom.zoom);
-				break;
-			case MESSAGE_TYPE_SCROLL:
-				this->GetClient()->SetScroll(
-				    this->GetBrowser(), msg.scroll.vertical, msg.scroll.horizontal);
-				break;
-			case MESSAGE_TYPE_ACTIVE_STATE_CHANGE:
-				this->UpdateActiveStateJS(msg.active_state.active);
-				break;
-			case MESSAGE_TYPE_VISIBILITY_CHANGE:
-				this->UpdateVisibilityStateJS(msg.visibility.visible);
+		if (fds[0].revents && !ReceiveAttach()) {
+			/* the single source a browser was started for stays until the
+			 * plugin kills it, the shared host goes away with the plugin */
+			if (host) {
+				CefPostTask(TID_UI, new FunctionTask([] { CefQuitMessageLoop(); }));
 				break;
 			}
+			fds[0].fd = -1;
 		}
 	}
 }
 
-void BrowserApp::SizeChanged()
+/* a source that came to a browser not started for it, the shared host or a
+ * pooled one, still keeps its cookies and storage in its own cache */
+void BrowserApp::AddInstance(CefRefPtr<BrowserInstance> instance)
 {
-	pthread_mutex_lock(&data->mutex);
-	width = data->width;
-	height = data->height;
+	CefRefPtr<CefRequestContext> context;
+	const std::string& cache = instance->GetCacheName();
+	if (!cache.empty() && cache != cacheName) {
+		CefRequestContextSettings settings;
+		CefString(&settings.cache_path).FromString(cacheDir + cache);
+		context = CefRequestContext::CreateContext(settings, nullptr);
+	}
 
-	browser->GetHost()->WasResized();
-	pthread_mutex_unlock(&data->mutex);
+	instances[instance->GetId()] = instance;
+	instance->Start(context);
 }
 
-void BrowserApp::UrlChanged(const char* url)
+void BrowserApp::DetachInstance(uint32_t id)
 {
-	this->UrlChanged(std::string(url));
-}
-
-void BrowserApp::UrlChanged(std::string url)
-{
-	CefString cef_url;
-	cef_url.FromString(url);
-	browser->GetMainFrame()->LoadURL(cef_url);
-
-	if (in_wd >= 0) {
-		inotify_rm_watch(in_fd, in_wd);
-		in_wd = -1;
-	}
-
-	if (beginsWith(url, "file:///")) {
-		in_wd = inotify_add_watch(in_fd, url.substr(8).c_str(), IN_MODIFY);
+	auto it = instances.find(id);
+	if (it != instances.end()) {
+		CefRefPtr<BrowserApp> app{this};
+		it->second->Close([app, id] { app->instances.erase(id); });
 	}
 }
 
-void BrowserApp::CssChanged(const char* css_file)
+// reload local files whenever they change on disk
+void BrowserApp::ReloadWatched(int wd)
 {
-	std::ifstream t{css_file, std::ifstream::in};
-	if (t.good()) {
-		std::stringstream buffer;
-		buffer << t.rdbuf();
-		css = buffer.str();
-	} else {
-		css = "";
+	auto watch = watches.find(wd);
+	if (watch == watches.end())
+		return;
+	for (uint32_t id : watch->second) {
+		auto it = instances.find(id);
+		if (it != instances.end())
+			it->second->ReloadPage();
 	}
-
-	client->ChangeCss(css);
 }
 
-void BrowserApp::JsChanged(std::string jsFile)
+/* watch path for the instance id, returns the watch descriptor or -1 */
+int BrowserApp::WatchFile(const std::string& path, uint32_t id)
 {
-	std::ifstream t{jsFile, std::ifstream::in};
-	if (t.good()) {
-		std::stringstream buf;
-		buf << t.rdbuf();
-		this->js = buf.str();
-	} else {
-		this->js = "";
-	}
-
-	this->client->ChangeJs(this->js);
+	int wd = inotify_add_watch(in_fd, path.c_str(), IN_MODIFY);
+	if (wd >= 0)
+		watches[wd].insert(id);
+	return wd;
 }
 
-void BrowserApp::ReloadPage()
+/* the file is only let go once no instance watches it anymore */
+void BrowserApp::UnwatchFile(int wd, uint32_t id)
 {
-	browser->ReloadIgnoreCache();
+	auto watch = watches.find(wd);
+	if (watch == watches.end())
+		return;
+	watch->second.erase(id);
+	if (watch->second.empty()) {
+		inotify_rm_watch(in_fd, wd);
+		watches.erase(watch);
+	}
 }
 
-// Browser instance is being initialized here
+// Browser instances are being initialized here
 void BrowserApp::OnContextInitialized()
 {
-	if (shm_name.empty())
+	if (ipc_fd < 0)
 		return;
 
-	CefWindowInfo info;
-	info.width = width;
-	info.height = height;
-	info.windowless_rendering_enabled = true;
-
-	CefBrowserSettings settings;
-	settings.windowless_frame_rate = fps;
-
-	CefRefPtr<BrowserClient> client{new BrowserClient(data, css)};
-	this->client = client;
-
-	browser = CefBrowserHost::CreateBrowserSync(
-	    info, client.get(), "https://github.com/bazukas/obs-linuxbrowser/", settings, nullptr);
-	client->SetScroll(browser, 0, 0); // workaround for scroll to bottom bug
-
-	messageThread = std::thread{[this] { this->MessageThreadWorker(); }};
+	initialized = true;
+	if (first) {
+		AddInstance(first);
+		first = nullptr;
+	}
+	std::thread{[this] { this->AttachThreadWorker(); }}.detach();
 }
 
 void BrowserApp::OnContextCreated(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
@@ -379,18 +337,3 @@ bool BrowserApp::Execute(const CefString& name, CefRefPtr<CefV8Value> object,
 {
 	return true;
 }
-
-void BrowserApp::UpdateActiveStateJS(bool active)
-{
-	CefRefPtr<CefProcessMessage> msg{CefProcessMessage::Create("Active")};
-	msg->GetArgumentList()->SetBool(0, active);
-	this->browser->SendProcessMessage(PID_BROWSER, msg);
-}
-
-void BrowserApp::UpdateVisibilityStateJS(bool visible)
-{
-	CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("Visibility");
-	CefRefPtr<CefListValue> args = msg->GetArgumentList();
-	args->SetBool(0, visible);
-	this->browser->SendProcessMessage(PID_BROWSER, msg);
-}
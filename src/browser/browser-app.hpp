@@ -17,14 +17,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #pragma once
 
+#include <map>
+#include <set>
 #include <string>
-#include <thread>
 
 #include <cef_app.h>
 
-#include "browser-client.hpp"
+#include "blit.hpp"
+#include "browser-instance.hpp"
 #include "shared.h"
-#include "split-message.hpp"
 
 class BrowserApp
         : public CefApp
@@ -32,7 +33,7 @@ class BrowserApp
         , public CefRenderProcessHandler
         , public CefV8Handler {
 public:
-	BrowserApp(char* shm_name);
+	BrowserApp(int ipc_fd, std::string cacheDir = "", std::string cacheName = "");
 	~BrowserApp();
 
 	virtual CefRefPtr<CefBrowserProcessHandler> GetBrowserProcessHandler() OVERRIDE
@@ -47,26 +48,6 @@ public:
 
 	virtual void OnContextInitialized() OVERRIDE;
 
-	int GetQueueId()
-	{
-		return qid;
-	}
-	CefRefPtr<CefBrowser> GetBrowser()
-	{
-		return browser;
-	}
-	void SizeChanged();
-	void UrlChanged(const char* url);
-	void UrlChanged(std::string url);
-	void CssChanged(const char* css_file);
-	void JsChanged(std::string jsFile);
-	void ReloadPage();
-
-	CefRefPtr<BrowserClient> GetClient()
-	{
-		return client;
-	}
-
 	void OnBeforeCommandLineProcessing(const CefString& process_type,
 	                                   CefRefPtr<CefCommandLine> command_line) override;
 
@@ -77,37 +58,52 @@ public:
 	                                      CefProcessId source_process,
 	                                      CefRefPtr<CefProcessMessage> message) override;
 
-	void UpdateActiveStateJS(bool active);
-	void UpdateVisibilityStateJS(bool visible);
-
 	virtual bool Execute(const CefString& name, CefRefPtr<CefV8Value> object,
 	                     const CefV8ValueList& arguments, CefRefPtr<CefV8Value>& retval,
 	                     CefString& exception) override;
 
+	// before CefInitialize, with the app already held by a CefRefPtr
+	void ReceiveFirstAttach();
+
+	// UI thread only
+	void AddInstance(CefRefPtr<BrowserInstance> instance);
+	void DetachInstance(uint32_t id);
+	void ReloadWatched(int wd);
+	// inotify hands out one watch per file, these count who is on it
+	int WatchFile(const std::string& path, uint32_t id);
+	void UnwatchFile(int wd, uint32_t id);
+
+	BlitPool& GetBlitPool()
+	{
+		return blitPool;
+	}
+
 private:
-	void InitSharedData();
-	void UninitSharedData();
+	bool ReceiveAttach();
+	void AttachThreadWorker();
 
 	void ExecuteJSFunction(CefRefPtr<CefBrowser> browser, const char* functionName,
 	                       CefV8ValueList arguments);
 
-	void MessageThreadWorker();
-
 private:
-	CefRefPtr<CefBrowser> browser;
-	CefRefPtr<BrowserClient> client;
-	std::thread messageThread;
-	std::string shm_name;
-	uint32_t width;
-	uint32_t height;
-	int fps;
-	int fd;
-	int qid;
-	shared_data_t* data;
-	std::string css;
-	std::string js;
-	int in_fd;
-	int in_wd{-1};
+	int ipc_fd{-1};
+	// whether this process is the shared host, see SHARED_ATTACH_HOST
+	bool host{false};
+	// the source attached before CefInitialize, picked up by
+	// OnContextInitialized
+	CefRefPtr<BrowserInstance> first;
+	bool initialized{false};
+	// one set of copy threads for all browsers, they all paint on the UI thread
+	BlitPool blitPool;
+	// every source's browser by the id it was attached under, UI thread only
+	std::map<uint32_t, CefRefPtr<BrowserInstance>> instances;
+	int in_fd{-1};
+	// the ids of the instances reloaded on changes to each watched file,
+	// UI thread only
+	std::map<int, std::set<uint32_t>> watches;
+	// where the caches live and the one this process was started with
+	std::string cacheDir;
+	std::string cacheName;
 
 	IMPLEMENT_REFCOUNTING(BrowserApp);
 };
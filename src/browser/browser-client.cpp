@@ -16,43 +16,393 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
 #include <algorithm>
 #include <cmath>
 
 #include "base64.hpp"
 #include "browser-client.hpp"
 
-BrowserClient::BrowserClient(shared_data_t* data, std::string css)
+BrowserClient::BrowserClient(shared_data_t* data, uint32_t owner, int fd, int statusDoorbell,
+                             BlitPool& blitPool, std::string css)
+    : blitPool(blitPool)
 {
 	this->data = data;
+	this->owner = owner;
+	this->fd = fd;
+	this->statusDoorbell = statusDoorbell;
 	this->css = css;
 }
 
+BrowserClient::~BrowserClient()
+{
+	if (frames)
+		munmap(frames, framesSize);
+}
+
+/* pick up a new frame layout from the plugin, mapping the grown frame area
+ * if needed */
+bool BrowserClient::UpdateLayout()
+{
+	uint32_t current = __atomic_load_n(&data->layout_generation, __ATOMIC_ACQUIRE);
+	if (frames && current == layout)
+		return true;
+
+	shared_lock(&data->mutex);
+	layout = data->layout_generation;
+	width = data->width;
+	height = data->height;
+	pitch = data->frame_pitch;
+	frameSize = data->frame_size;
+	mode = data->frame_mode;
+	size_t areaSize = data->frame_area_size;
+	pthread_mutex_unlock(&data->mutex);
+
+	if (areaSize > framesSize) {
+		void* mapped;
+		if (frames)
+			mapped = mremap(frames, framesSize, areaSize, MREMAP_MAYMOVE);
+		else
+			mapped = mmap(nullptr, areaSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			              SHARED_FRAME_OFFSET);
+		if (mapped == MAP_FAILED) {
+			if (frames)
+				munmap(frames, framesSize);
+			frames = nullptr;
+			framesSize = 0;
+			return false;
+		}
+		frames = static_cast<uint8_t*>(mapped);
+		framesSize = areaSize;
+		if (data->huge_pages)
+			madvise(frames, framesSize, MADV_HUGEPAGE);
+	}
+	return true;
+}
+
 BC_GET_VIEW_RECT_RETURN_TYPE BrowserClient::GetViewRect(CefRefPtr<CefBrowser> browser,
                                                         CefRect& rect)
 {
-	pthread_mutex_lock(&data->mutex);
+	shared_lock(&data->mutex);
 	rect.Set(0, 0, data->width, data->height);
 	pthread_mutex_unlock(&data->mutex);
 	BC_GET_VIEW_RECT_RETURN
 }
 
+namespace
+{
+// enough history to bring a slot up to date after the plugin skipped a few
+// frames, older slots simply get a full copy
+const size_t MAX_DAMAGE_HISTORY = 8;
+// how long a paint may wait for the plugin to free a slot in fifo mode
+// before the frame is dropped instead of stalling CEF indefinitely
+const uint64_t FIFO_WAIT_NS = 100000000;
+const uint64_t STATS_INTERVAL_NS = 1000000000;
+// the governor lowers the rate of a page that stayed below it for
+// GOVERN_IDLE_NS, halving it at most once per call, and any paint with damage
+// brings it straight back up. Staying below the rate means no paint covering
+// 1 / GOVERN_BURST_AREA of the view or more, and no paints keeping up with
+// the rate for GOVERN_SATURATED_NS. Keeping up means GOVERN_SATURATED_PERCENT
+// of the rate, CEF's timer drifts and a page painting every frame rarely
+// makes the full count.
+const uint64_t GOVERN_IDLE_NS = 2000000000;
+const uint64_t GOVERN_BURST_AREA = 64;
+const uint64_t GOVERN_SATURATED_NS = 250000000;
+const uint64_t GOVERN_SATURATED_PERCENT = 80;
+
+CefRect bounding_rect(const CefRenderHandler::RectList& rects)
+{
+	CefRect bounds = rects.front();
+	for (const CefRect& r : rects) {
+		int right = std::max(bounds.x + bounds.width, r.x + r.width);
+		int bottom = std::max(bounds.y + bounds.height, r.y + r.height);
+		bounds.x = std::min(bounds.x, r.x);
+		bounds.y = std::min(bounds.y, r.y);
+		bounds.width = right - bounds.x;
+		bounds.height = bottom - bounds.y;
+	}
+	return bounds;
+}
+
+void copy_rect(BlitPool& pool, uint8_t* dst, size_t dst_pitch, const uint8_t* src,
+               size_t src_pitch, CefRect r, int width, int height)
+{
+	int right = std::min(r.x + r.width, width);
+	int bottom = std::min(r.y + r.height, height);
+	r.x = std::max(r.x, 0);
+	r.y = std::max(r.y, 0);
+	if (right <= r.x || bottom <= r.y)
+		return;
+
+	pool.Blit(dst + r.y * dst_pitch + r.x * 4, dst_pitch, src + r.y * src_pitch + r.x * 4,
+	          src_pitch, size_t(right - r.x) * 4, bottom - r.y);
+}
+} // namespace
+
 void BrowserClient::OnPaint(CefRefPtr<CefBrowser> browser, CefRenderHandler::PaintElementType type,
                             const CefRenderHandler::RectList& dirtyRects, const void* buffer,
                             int vwidth, int vheight)
 {
 	// Don't draw popups for now
-	if (type == PET_VIEW) {
-		pthread_mutex_lock(&data->mutex);
-		size_t len = std::min(vwidth * vheight * 4, int(data->width * data->height * 4));
-		std::memcpy(&data->data, buffer, len);
-		pthread_mutex_unlock(&data->mutex);
+	if (type != PET_VIEW || suspended || !Owned())
+		return;
+
+	uint64_t timestamp = shared_time_ns();
+	WatchActivity(dirtyRects, vwidth, vheight, timestamp);
+	// the first change after a quiet spell must not lag behind
+	if (fpsRate < fpsCeiling && !dirtyRects.empty())
+		SetFrameRate(browser, fpsCeiling);
+	if (!UpdateLayout())
+		return;
+
+	damageHistory.push_back({data->frame_generation + 1, dirtyRects});
+	if (damageHistory.size() > MAX_DAMAGE_HISTORY)
+		damageHistory.pop_front();
+
+	uint32_t slot = data->frame_back;
+	if (mode == SHARED_FRAME_MODE_FIFO && !WaitForFifoSlot(slot))
+		return;
+	shared_frame_t* frame = &data->frames[slot];
+	uint8_t* dst = shared_frame_pixels(frames, frameSize, slot);
+	const uint8_t* src = static_cast<const uint8_t*>(buffer);
+	int copy_width = std::min(vwidth, int(width));
+	int copy_height = std::min(vheight, int(height));
+
+	// the slot still holds an older frame, only bring over what changed since
+	RectList rects;
+	if (frame->layout != layout || !CollectDamage(frame->generation, rects))
+		rects = {CefRect(0, 0, copy_width, copy_height)};
+
+	uint64_t copyStart = shared_time_ns();
+	for (const CefRect& r : rects)
+		copy_rect(blitPool, dst, pitch, src, vwidth * 4, r, copy_width, copy_height);
+	CountPaint(timestamp, shared_time_ns() - copyStart);
+
+	// a replacement may have taken over during the copy, the slot is its now
+	if (!Owned())
+		return;
+	frame->layout = layout;
+	frame->timestamp = timestamp;
+	frame->width = width;
+	frame->height = height;
+	WriteFrameDamage(frame);
+	if (mode == SHARED_FRAME_MODE_FIFO)
+		shared_fifo_push(data);
+	else
+		shared_frame_publish(data);
+}
+
+bool BrowserClient::WaitForFifoSlot(uint32_t& slot)
+{
+	uint64_t deadline = shared_time_ns() + FIFO_WAIT_NS;
+	while (true) {
+		uint32_t seq = __atomic_load_n(&data->fifo_seq, __ATOMIC_ACQUIRE);
+		if (shared_fifo_writable(data, &slot))
+			return true;
+
+		uint64_t now = shared_time_ns();
+		if (now >= deadline)
+			return false;
+		shared_wait(&data->fifo_seq, &data->fifo_waiters, seq, deadline - now);
+	}
+}
+
+/* collects everything painted after frame `since` into rects, collapsed into
+ * one bounding rect if there are many. Returns false if the history does not
+ * reach back that far. */
+bool BrowserClient::CollectDamage(uint64_t since, RectList& rects) const
+{
+	if (since == 0 || damageHistory.empty() || damageHistory.front().generation > since + 1)
+		return false;
+
+	for (const PaintDamage& damage : damageHistory) {
+		if (damage.generation > since)
+			rects.insert(rects.end(), damage.rects.begin(), damage.rects.end());
 	}
+	if (rects.size() > SHARED_MAX_DIRTY_RECTS)
+		rects = {bounding_rect(rects)};
+	return true;
+}
+
+/* describe the damage of the newest paint, reaching back over as many older
+ * paints as fit into the frame header */
+void BrowserClient::WriteFrameDamage(shared_frame_t* frame) const
+{
+	const PaintDamage& newest = damageHistory.back();
+	RectList rects = newest.rects;
+	uint64_t base = newest.generation - 1;
+
+	if (rects.size() > SHARED_MAX_DIRTY_RECTS) {
+		rects = {bounding_rect(rects)};
+	} else {
+		for (auto it = damageHistory.rbegin() + 1; it != damageHistory.rend(); ++it) {
+			if (rects.size() + it->rects.size() > SHARED_MAX_DIRTY_RECTS)
+				break;
+			rects.insert(rects.end(), it->rects.begin(), it->rects.end());
+			base = it->generation - 1;
+		}
+	}
+
+	frame->damage_base = base;
+	frame->rect_count = rects.size();
+	for (size_t i = 0; i < rects.size(); i++) {
+		frame->rects[i].x = std::max(rects[i].x, 0);
+		frame->rects[i].y = std::max(rects[i].y, 0);
+		frame->rects[i].width = std::max(rects[i].width, 0);
+		frame->rects[i].height = std::max(rects[i].height, 0);
+	}
+}
+
+/* queue a report for the plugin. All callers run on the CEF UI thread, which
+ * keeps the status ring single producer. */
+void BrowserClient::SendStatus(const uint8_t* msg, size_t size)
+{
+	uint64_t pos;
+	if (size == 0 || !Owned() || !shared_ring_push(&data->status, msg, size, &pos))
+		return;
+	if (shared_ring_needs_doorbell(&data->status))
+		eventfd_write(statusDoorbell, 1);
+}
+
+void BrowserClient::CountPaint(uint64_t start, uint64_t copied)
+{
+	if (statsStart == 0)
+		statsStart = start;
+	paints++;
+	copyTotal += copied;
+	copyMax = std::max(copyMax, copied);
+	if (start - statsStart >= STATS_INTERVAL_NS)
+		SendPaintStats(start);
+}
+
+void BrowserClient::SendPaintStats(uint64_t now)
+{
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	SendStatus(buf, browser_encode_paint_stats(buf, sizeof(buf), (now - statsStart) / 1000000,
+	                                           paints, paints ? copyTotal / paints / 1000 : 0,
+	                                           copyMax / 1000, fpsRate));
+	statsStart = now;
+	paints = 0;
+	copyTotal = 0;
+	copyMax = 0;
+}
+
+/* a page is busy while it repaints large parts of the view or paints as
+ * often as the current rate allows, after small updates like a ticking clock
+ * the rate may go down again */
+void BrowserClient::WatchActivity(const RectList& dirtyRects, int vwidth, int vheight,
+                                  uint64_t now)
+{
+	uint64_t area = 0;
+	for (const CefRect& r : dirtyRects)
+		area += uint64_t(r.width) * r.height;
+
+	governPaints++;
+	bool busy = area * GOVERN_BURST_AREA >= uint64_t(vwidth) * vheight
+	       || (now - governStart >= GOVERN_SATURATED_NS
+	           && governPaints * 1000000000ULL * 100
+	                  >= uint64_t(fpsRate) * (now - governStart) * GOVERN_SATURATED_PERCENT);
+	if (busy)
+		busyTs = now;
+}
+
+/* called about once a second, steps the rate down towards the floor while
+ * the page stays below it */
+void BrowserClient::Govern(CefRefPtr<CefBrowser> browser, uint64_t now)
+{
+	uint64_t elapsed = now - governStart;
+	uint32_t painted = governPaints;
+	governStart = now;
+	governPaints = 0;
+	if (suspended || fpsRate <= fpsFloor || now - busyTs < GOVERN_IDLE_NS || elapsed == 0)
+		return;
+
+	// twice what the page painted, so its updates still land in time
+	int wanted = int(painted * 2000000000ULL / elapsed) + 1;
+	int rate = std::max({fpsFloor, fpsRate / 2, wanted});
+	if (rate >= fpsRate)
+		return;
+	SetFrameRate(browser, rate);
+	SendPaintStats(now);
+}
+
+/* ceiling is the rate the plugin asked for, floor the lowest one the
+ * governor may go down to */
+void BrowserClient::SetFrameRates(CefRefPtr<CefBrowser> browser, int ceiling, int floor)
+{
+	fpsCeiling = ceiling;
+	fpsFloor = floor > 0 && floor < ceiling ? floor : ceiling;
+	SetFrameRate(browser, ceiling);
+}
+
+void BrowserClient::SetSuspended(CefRefPtr<CefBrowser> browser, bool suspended)
+{
+	this->suspended = suspended;
+	SetFrameRate(browser, fpsCeiling);
+}
+
+// CEF does not go below one frame per second while suspended
+void BrowserClient::SetFrameRate(CefRefPtr<CefBrowser> browser, int rate)
+{
+	fpsRate = rate;
+	busyTs = shared_time_ns();
+	browser->GetHost()->SetWindowlessFrameRate(suspended ? 1 : rate);
+}
+
+void BrowserClient::OnLoadStart(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
+                                TransitionType transition_type)
+{
+	if (!frame->IsMain())
+		return;
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	SendStatus(buf, browser_encode_load_start(buf, sizeof(buf)));
+}
+
+void BrowserClient::OnLoadError(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
+                                ErrorCode errorCode, const CefString& errorText,
+                                const CefString& failedUrl)
+{
+	if (!frame->IsMain() || errorCode == ERR_ABORTED)
+		return;
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	SendStatus(buf, browser_encode_load_error(buf, sizeof(buf), errorCode));
+}
+
+void BrowserClient::OnRenderProcessTerminated(CefRefPtr<CefBrowser> browser,
+                                              TerminationStatus status)
+{
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	SendStatus(buf, browser_encode_render_terminated(buf, sizeof(buf), status));
+}
+
+// whether the plugin still sends frames and status reports to this browser
+bool BrowserClient::Owned() const
+{
+	return !__atomic_load_n(&detached, __ATOMIC_ACQUIRE)
+	       && __atomic_load_n(&data->owner, __ATOMIC_ACQUIRE) == owner;
+}
+
+void BrowserClient::Detach(std::function<void()> closed)
+{
+	this->closed = closed;
+	__atomic_store_n(&detached, true, __ATOMIC_RELEASE);
+}
+
+void BrowserClient::OnBeforeClose(CefRefPtr<CefBrowser> browser)
+{
+	if (closed)
+		closed();
 }
 
 void BrowserClient::OnLoadEnd(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
                               int httpStatusCode)
 {
+	if (frame->IsMain()) {
+		uint8_t buf[MAX_MESSAGE_SIZE];
+		SendStatus(buf, browser_encode_load_end(buf, sizeof(buf), httpStatusCode));
+	}
 	if (frame->IsMain() && css != "") {
 		std::string base64EncodedCSS = base64_encode(
 		    reinterpret_cast<const unsigned char*>(css.c_str()), css.length());
@@ -70,6 +420,25 @@ void BrowserClient::OnLoadEnd(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame>
 	if (frame->IsMain() && js != "") {
 		frame->ExecuteJavaScript(this->js, "", 0);
 	}
+	ApplyViewState(browser);
+}
+
+/* takes over the view settings of a config message without touching the
+ * page, the next ApplyViewState or page load puts them into effect */
+void BrowserClient::StoreViewState(const struct browser_message_config& config)
+{
+	if (config.changed & BROWSER_CONFIG_SCROLLBARS)
+		this->show_scrollbars = config.scrollbars;
+	if (config.changed & BROWSER_CONFIG_ZOOM)
+		this->zoom = config.zoom;
+	if (config.changed & BROWSER_CONFIG_SCROLL) {
+		this->scroll_vertical = config.scroll_vertical;
+		this->scroll_horizontal = config.scroll_horizontal;
+	}
+}
+
+void BrowserClient::ApplyViewState(CefRefPtr<CefBrowser> browser)
+{
 	SetScrollbars(browser, show_scrollbars);
 	SetZoom(browser, zoom);
 }
@@ -17,8 +17,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #pragma once
 
+#include <deque>
+#include <functional>
+
 #include <cef_client.h>
 
+#include "blit.hpp"
 #include "shared.h"
 
 #include "config.h"
@@ -26,9 +30,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 class BrowserClient
         : public CefClient
         , public CefRenderHandler
-        , public CefLoadHandler {
+        , public CefLoadHandler
+        , public CefRequestHandler
+        , public CefLifeSpanHandler {
 public:
-	BrowserClient(shared_data_t* data, std::string css);
+	BrowserClient(shared_data_t* data, uint32_t owner, int fd, int statusDoorbell,
+	              BlitPool& blitPool, std::string css);
+	~BrowserClient();
 
 	virtual CefRefPtr<CefRenderHandler> GetRenderHandler() OVERRIDE
 	{
@@ -38,6 +46,14 @@ public:
 	{
 		return this;
 	}
+	virtual CefRefPtr<CefRequestHandler> GetRequestHandler() OVERRIDE
+	{
+		return this;
+	}
+	virtual CefRefPtr<CefLifeSpanHandler> GetLifeSpanHandler() OVERRIDE
+	{
+		return this;
+	}
 
 	virtual BC_GET_VIEW_RECT_RETURN_TYPE GetViewRect(CefRefPtr<CefBrowser> browser,
 	                                                 CefRect& rect) override;
@@ -45,8 +61,22 @@ public:
 	                     const CefRenderHandler::RectList& dirtyRects, const void* buffer,
 	                     int width, int height) OVERRIDE;
 
+	virtual void OnLoadStart(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
+	                         TransitionType transition_type) OVERRIDE;
 	virtual void OnLoadEnd(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
 	                       int httpStatusCode) OVERRIDE;
+	virtual void OnLoadError(CefRefPtr<CefBrowser> browser, CefRefPtr<CefFrame> frame,
+	                         ErrorCode errorCode, const CefString& errorText,
+	                         const CefString& failedUrl) OVERRIDE;
+
+	virtual void OnRenderProcessTerminated(CefRefPtr<CefBrowser> browser,
+	                                       TerminationStatus status) OVERRIDE;
+
+	virtual void OnBeforeClose(CefRefPtr<CefBrowser> browser) OVERRIDE;
+
+	/* stop touching the segment, the plugin may already hand it to another
+	 * browser. closed runs once CEF is done with the browser. */
+	void Detach(std::function<void()> closed);
 
 	void ChangeCss(std::string css)
 	{
@@ -56,15 +86,70 @@ public:
 	void SetScrollbars(CefRefPtr<CefBrowser> browser, bool show);
 	void SetZoom(CefRefPtr<CefBrowser> browser, uint32_t zoom);
 	void SetScroll(CefRefPtr<CefBrowser> browser, uint32_t vertical, uint32_t horizontal);
+	void StoreViewState(const struct browser_message_config& config);
+	void SetSuspended(CefRefPtr<CefBrowser> browser, bool suspended);
+	void SetFrameRates(CefRefPtr<CefBrowser> browser, int ceiling, int floor);
+	void Govern(CefRefPtr<CefBrowser> browser, uint64_t now);
+	void ApplyViewState(CefRefPtr<CefBrowser> browser);
 
 private:
+	bool UpdateLayout();
+	bool WaitForFifoSlot(uint32_t& slot);
+	bool CollectDamage(uint64_t since, RectList& rects) const;
+	void WriteFrameDamage(shared_frame_t* frame) const;
+	bool Owned() const;
+	void SendStatus(const uint8_t* msg, size_t size);
+	void CountPaint(uint64_t start, uint64_t copied);
+	void SendPaintStats(uint64_t now);
+	void SetFrameRate(CefRefPtr<CefBrowser> browser, int rate);
+	void WatchActivity(const RectList& dirtyRects, int vwidth, int vheight, uint64_t now);
+
+	struct PaintDamage {
+		uint64_t generation;
+		RectList rects;
+	};
+
 	shared_data_t* data;
+	uint32_t owner;
+	bool detached{false};
+	// no copies while the plugin has the source suspended
+	bool suspended{false};
+	std::function<void()> closed;
+	int fd;
+	int statusDoorbell;
+	uint8_t* frames{nullptr};
+	size_t framesSize{0};
+	uint32_t layout{0};
+	uint32_t width{0};
+	uint32_t height{0};
+	uint32_t pitch{0};
+	size_t frameSize{0};
+	uint32_t mode{SHARED_FRAME_MODE_LATEST};
+	std::deque<PaintDamage> damageHistory;
+	// shared by every browser of the process, see BrowserApp
+	BlitPool& blitPool;
 	std::string css;
 	std::string js;
 	bool show_scrollbars{true};
-	uint32_t zoom;
-	uint32_t scroll_vertical;
-	uint32_t scroll_horizontal;
+	uint32_t zoom{100};
+	uint32_t scroll_vertical{0};
+	uint32_t scroll_horizontal{0};
+
+	// paints since statsStart, reported about once a second
+	uint64_t statsStart{0};
+	uint32_t paints{0};
+	uint64_t copyTotal{0};
+	uint64_t copyMax{0};
+
+	// the governor's rate between fpsFloor and fpsCeiling, paints counts
+	// those since the last Govern call and busyTs is when the page last
+	// needed the full rate
+	int fpsCeiling{0};
+	int fpsFloor{0};
+	int fpsRate{0};
+	uint64_t governStart{0};
+	uint32_t governPaints{0};
+	uint64_t busyTs{0};
 
 	IMPLEMENT_REFCOUNTING(BrowserClient);
 };
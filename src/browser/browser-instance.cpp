@@ -0,0 +1,621 @@
+/*
+Copyright (C) 2017 by Azat Khasanshin <azat.khasanshin@gmail.com>
+Copyright (C) 2018 by Adrian Schollmeyer <nexadn@yandex.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iostream>
+
+#include <cef_task.h>
+
+#include "browser-app.hpp"
+#include "browser-instance.hpp"
+
+namespace
+{
+bool beginsWith(const std::string& base, const std::string& beginning)
+{
+	return base.substr(0, beginning.size()) == beginning;
+}
+} // namespace
+
+BrowserInstance::BrowserInstance(uint32_t id, const int* fds, BrowserApp& app) : app(app)
+{
+	this->id = id;
+	fd = fds[0];
+	doorbell = fds[1];
+	blobFd = fds[2];
+	statusDoorbell = fds[3];
+	wakeup = eventfd(0, EFD_CLOEXEC);
+	// a read after poll must not block if a replacement got to it first
+	fcntl(doorbell, F_SETFL, O_NONBLOCK);
+
+	void* map = mmap(nullptr, SHARED_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		std::cerr << "Browser: data mapping failed\n";
+		return;
+	}
+	data = reinterpret_cast<shared_data*>(map);
+	owner = __atomic_load_n(&data->owner, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&data->browser_protocol, BROWSER_PROTOCOL_VERSION, __ATOMIC_RELEASE);
+
+	shared_lock(&data->mutex);
+	width = data->width;
+	height = data->height;
+	fps = data->fps;
+	fpsIdle = data->fps_idle;
+	pthread_mutex_unlock(&data->mutex);
+
+	ReadBlob(data->startup.cache_offset, data->startup.cache_blob, cacheName);
+}
+
+BrowserInstance::~BrowserInstance()
+{
+	StopMessages();
+	if (data)
+		munmap(data, SHARED_HEADER_SIZE);
+	if (blobs)
+		munmap(blobs, blobsSize);
+	close(fd);
+	close(doorbell);
+	close(wakeup);
+	close(blobFd);
+	close(statusDoorbell);
+}
+
+/* creates the browser on the configured page in context, the global one if
+ * it is null, and starts taking commands */
+void BrowserInstance::Start(CefRefPtr<CefRequestContext> context)
+{
+	CefWindowInfo info;
+	info.width = width;
+	info.height = height;
+	info.windowless_rendering_enabled = true;
+#if BC_EXTERNAL_BEGIN_FRAME
+	beginFrame = data->startup.begin_frame;
+	info.external_begin_frame_enabled = beginFrame;
+#endif
+
+	CefBrowserSettings settings;
+	settings.windowless_frame_rate = fps;
+
+	struct browser_message_config view = {};
+	std::string url{ReadStartup(view)};
+	client = new BrowserClient(data, owner, fd, statusDoorbell, app.GetBlitPool(), css);
+	client->ChangeJs(js);
+	client->StoreViewState(view);
+
+	browser = CefBrowserHost::CreateBrowserSync(
+	    info, client.get(), url.empty() ? "about:blank" : url, settings, context);
+	WatchUrl(url);
+	client->ApplyViewState(browser); // workaround for scroll to bottom bug
+	client->SetFrameRates(browser, fps, fpsIdle);
+	if (data->startup.suspended)
+		Suspend(true);
+
+	messageThread = std::thread{[this] { this->MessageThreadWorker(); }};
+	Heartbeat();
+}
+
+/* wakes the message thread out of its doorbell wait and lets it finish, the
+ * lanes it already filled are dropped */
+void BrowserInstance::StopMessages()
+{
+	if (!messageThread.joinable())
+		return;
+
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	eventfd_write(wakeup, 1);
+	messageThread.join();
+
+	std::lock_guard<std::mutex> lock{laneMutex};
+	inputLane.clear();
+	controlLane.clear();
+}
+
+/* closes the browser of a detached source. Neither the browser nor the
+ * message thread touch the segment once this returns, closed runs when CEF let
+ * go of the browser and the instance may be dropped. */
+void BrowserInstance::Close(std::function<void()> closed)
+{
+	StopMessages();
+	WatchUrl("");
+	if (!browser) {
+		closed();
+		return;
+	}
+	client->Detach(closed);
+	browser->GetHost()->CloseBrowser(true);
+}
+
+/* take over the page state the plugin left in the header, so that the first
+ * load already goes to the configured page. Returns the url and fills view
+ * with the scrollbar, zoom and scroll settings. */
+std::string BrowserInstance::ReadStartup(struct browser_message_config& view)
+{
+	const shared_startup_t& startup = data->startup;
+
+	view.changed = startup.changed;
+	view.scrollbars = startup.scrollbars;
+	view.zoom = startup.zoom;
+	view.scroll_vertical = startup.scroll_vertical;
+	view.scroll_horizontal = startup.scroll_horizontal;
+
+	std::string url;
+	if (startup.changed & BROWSER_CONFIG_URL)
+		ReadBlob(startup.url_offset, startup.url_blob, url);
+	if (startup.changed & BROWSER_CONFIG_CSS)
+		ReadBlob(startup.css_offset, startup.css_blob, css);
+	if (startup.changed & BROWSER_CONFIG_JS)
+		ReadBlob(startup.js_offset, startup.js_blob, js);
+	return url;
+}
+
+/* copy a blob out of the arena and let the plugin know it may reuse the
+ * space, blobs have to be read in the order they are queued */
+bool BrowserInstance::ReadBlob(uint64_t offset, uint32_t generation, std::string& text)
+{
+	text.clear();
+	if (generation == 0)
+		return true;
+
+	// offset and size come from shared memory, none of the sums may wrap
+	if (offset > SIZE_MAX - sizeof(shared_blob_t)) {
+		std::cerr << "Browser: blob " << generation << " lies out of bounds\n";
+		return false;
+	}
+	size_t start = offset + sizeof(shared_blob_t);
+	shared_blob_t blob{};
+	if (MapBlobs(start))
+		blob = *reinterpret_cast<const shared_blob_t*>(blobs + offset);
+	if (blob.generation != generation || blob.size > SIZE_MAX - start
+	    || !MapBlobs(start + blob.size)) {
+		std::cerr << "Browser: blob " << generation << " is missing\n";
+		return false;
+	}
+
+	text.assign(reinterpret_cast<const char*>(blobs + start), blob.size);
+	__atomic_store_n(&data->blob_done, generation, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* the plugin grows the arena as needed, follow it once a blob lies beyond
+ * what is mapped */
+bool BrowserInstance::MapBlobs(size_t size)
+{
+	if (size <= blobsSize)
+		return true;
+
+	struct stat st;
+	if (fstat(blobFd, &st) == -1 || (size_t) st.st_size < size)
+		return false;
+	void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, blobFd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	if (blobs)
+		munmap(blobs, blobsSize);
+	blobs = reinterpret_cast<uint8_t*>(map);
+	blobsSize = st.st_size;
+	return true;
+}
+
+/* take the next message off the command ring, sleeping on the doorbell while
+ * it is empty if wait is set. Returns false without one once StopMessages was
+ * called or another browser took over the segment. Text in msg stays valid
+ * until the next call. */
+bool BrowserInstance::ReceiveMessage(browser_message_t& msg, bool wait)
+{
+	shared_ring_t* ring = &data->commands;
+
+	while (Receiving()) {
+		uint32_t size = shared_ring_pop(ring, messageBuffer, sizeof(messageBuffer));
+		/* the message may be meant for a replacement that took over
+		 * meanwhile, its startup state covers it */
+		if (!Receiving())
+			return false;
+		if (size > 0) {
+			if (size <= sizeof(messageBuffer)
+			    && browser_decode_message(messageBuffer, size, &msg))
+				return true;
+			std::cerr << "Browser: dropping malformed message\n";
+			continue;
+		}
+		if (!wait)
+			return false;
+
+		__atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (shared_ring_empty(ring)) {
+			struct pollfd fds[] = {{doorbell, POLLIN, 0}, {wakeup, POLLIN, 0}};
+			poll(fds, 2, -1);
+			/* a replacement shares the doorbell and the sleeping flag,
+			 * which are its own once it took over */
+			if (!Receiving())
+				return false;
+			eventfd_t count;
+			eventfd_read(doorbell, &count);
+		}
+		__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return false;
+}
+
+bool BrowserInstance::Receiving() const
+{
+	return !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)
+	       && __atomic_load_n(&data->owner, __ATOMIC_ACQUIRE) == owner;
+}
+
+namespace
+{
+class LaneTask : public CefTask {
+public:
+	LaneTask(CefRefPtr<BrowserInstance> instance) : instance(instance) {}
+
+	void Execute() override
+	{
+		instance->RunLanes();
+	}
+
+private:
+	CefRefPtr<BrowserInstance> instance;
+
+	IMPLEMENT_REFCOUNTING(LaneTask);
+};
+
+class HeartbeatTask : public CefTask {
+public:
+	HeartbeatTask(CefRefPtr<BrowserInstance> instance) : instance(instance) {}
+
+	void Execute() override
+	{
+		instance->Heartbeat();
+	}
+
+private:
+	CefRefPtr<BrowserInstance> instance;
+
+	IMPLEMENT_REFCOUNTING(HeartbeatTask);
+};
+
+bool is_input(const browser_message_t& msg)
+{
+	switch (msg.type) {
+	case MESSAGE_TYPE_MOUSE_CLICK:
+	case MESSAGE_TYPE_MOUSE_MOVE:
+	case MESSAGE_TYPE_MOUSE_WHEEL:
+	case MESSAGE_TYPE_FOCUS:
+	case MESSAGE_TYPE_KEY:
+	// frame requests are just as urgent
+	case MESSAGE_TYPE_BEGIN_FRAME:
+		return true;
+	default:
+		return false;
+	}
+}
+} // namespace
+
+/* copy the blobs msg refers to, returns false if the url one is gone and the
+ * message has to be dropped */
+bool BrowserInstance::ReadCommand(const browser_message_t& msg, Command& command)
+{
+	command.msg = msg;
+	switch (msg.type) {
+	case MESSAGE_TYPE_URL:
+		return ReadBlob(msg.url.offset, msg.url.blob, command.url);
+	case MESSAGE_TYPE_CSS:
+		return ReadBlob(msg.css.offset, msg.css.blob, command.css);
+	case MESSAGE_TYPE_JS:
+		return ReadBlob(msg.js.offset, msg.js.blob, command.js);
+	case MESSAGE_TYPE_CONFIG: {
+		struct browser_message_config& config = command.msg.config;
+		if (config.changed & BROWSER_CONFIG_URL
+		    && !ReadBlob(config.url_offset, config.url_blob, command.url))
+			return false;
+		if (config.changed & BROWSER_CONFIG_CSS
+		    && !ReadBlob(config.css_offset, config.css_blob, command.css))
+			config.changed &= ~BROWSER_CONFIG_CSS;
+		if (config.changed & BROWSER_CONFIG_JS
+		    && !ReadBlob(config.js_offset, config.js_blob, command.js))
+			config.changed &= ~BROWSER_CONFIG_JS;
+		return true;
+	}
+	default:
+		return true;
+	}
+}
+
+/* tells the plugin's watchdog that the UI thread is still going, until the
+ * instance is closed or replaced */
+void BrowserInstance::Heartbeat()
+{
+	if (!Receiving())
+		return;
+	uint64_t now = shared_time_ns();
+	__atomic_store_n(&data->heartbeat, now, __ATOMIC_RELEASE);
+	client->Govern(browser, now);
+	CefPostDelayedTask(TID_UI, new HeartbeatTask(this), SHARED_HEARTBEAT_MS);
+}
+
+// Message receiver loop: drains the ring in batches, sorting input and
+// everything else into separate lanes the UI thread works off
+void BrowserInstance::MessageThreadWorker()
+{
+	browser_message_t msg;
+	browser_message_t next;
+
+	while (ReceiveMessage(msg, true)) {
+
+		std::deque<Command> input;
+		std::deque<Command> control;
+		bool more = true;
+		while (more) {
+			more = ReceiveMessage(next, false);
+			// merge input events with whatever else is already queued behind them
+			if (more && browser_message_coalescable(&msg)
+			    && browser_coalesce_message(&msg, &next)) {
+				__atomic_add_fetch(&data->commands.merged, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+
+			Command command;
+			if (ReadCommand(msg, command))
+				(is_input(msg) ? input : control).push_back(std::move(command));
+			msg = next;
+		}
+
+		bool post = false;
+		{
+			std::lock_guard<std::mutex> lock{laneMutex};
+			for (Command& command : input)
+				inputLane.push_back(std::move(command));
+			for (Command& command : control)
+				controlLane.push_back(std::move(command));
+			post = !lanesPosted;
+			lanesPosted = true;
+		}
+		if (post)
+			CefPostTask(TID_UI, new LaneTask(this));
+	}
+}
+
+/* works off both lanes, taking all pending input before each control
+ * command so that input never waits behind a page load */
+void BrowserInstance::RunLanes()
+{
+	std::unique_lock<std::mutex> lock{laneMutex};
+	while (!inputLane.empty() || !controlLane.empty()) {
+		std::deque<Command>& lane = inputLane.empty() ? controlLane : inputLane;
+		Command command{std::move(lane.front())};
+		lane.pop_front();
+
+		lock.unlock();
+		DispatchCommand(command);
+		lock.lock();
+	}
+	lanesPosted = false;
+}
+
+void BrowserInstance::DispatchCommand(const Command& command)
+{
+	const browser_message_t& msg = command.msg;
+	CefMouseEvent e;
+	CefKeyEvent ke;
+
+	switch (msg.type) {
+	case MESSAGE_TYPE_URL:
+		this->UrlChanged(command.url);
+		break;
+	case MESSAGE_TYPE_SIZE:
+		this->SizeChanged();
+		break;
+	case MESSAGE_TYPE_FPS:
+		this->FpsChanged();
+		break;
+	case MESSAGE_TYPE_BEGIN_FRAME:
+		this->BeginFrame();
+		break;
+	case MESSAGE_TYPE_RELOAD:
+		this->ReloadPage();
+		break;
+	case MESSAGE_TYPE_CSS:
+		this->CssChanged(command.css);
+		break;
+	case MESSAGE_TYPE_JS:
+		this->JsChanged(command.js);
+		break;
+	case MESSAGE_TYPE_MOUSE_CLICK:
+		e.modifiers = msg.mouse_click.modifiers;
+		e.x = msg.mouse_click.x;
+		e.y = msg.mouse_click.y;
+		this->GetBrowser()->GetHost()->SendMouseClickEvent(
+		    e, static_cast<CefBrowserHost::MouseButtonType>(msg.mouse_click.button_type),
+		    msg.mouse_click.mouse_up, msg.mouse_click.click_count);
+		break;
+	case MESSAGE_TYPE_MOUSE_MOVE:
+		e.modifiers = msg.mouse_move.modifiers;
+		e.x = msg.mouse_move.x;
+		e.y = msg.mouse_move.y;
+		this->GetBrowser()->GetHost()->SendMouseMoveEvent(e, msg.mouse_move.mouse_leave);
+		break;
+	case MESSAGE_TYPE_MOUSE_WHEEL:
+		e.modifiers = msg.mouse_wheel.modifiers;
+		e.x = msg.mouse_wheel.x;
+		e.y = msg.mouse_wheel.y;
+		this->GetBrowser()->GetHost()->SendMouseWheelEvent(
+		    e, msg.mouse_wheel.x_delta, msg.mouse_wheel.y_delta);
+		break;
+	case MESSAGE_TYPE_FOCUS:
+		this->GetBrowser()->GetHost()->SendFocusEvent(msg.focus.focus);
+		break;
+	case MESSAGE_TYPE_KEY:
+		/* I have no idea what is happening */
+		ke.windows_key_code = msg.key.native_vkey;
+		ke.native_key_code = msg.key.native_vkey;
+		ke.modifiers = msg.key.modifiers;
+		ke.type = msg.key.key_up ? KEYEVENT_KEYUP : KEYEVENT_RAWKEYDOWN;
+		if (msg.key.chr != 0) {
+			ke.character = msg.key.chr;
+			if (!msg.key.key_up)
+				ke.type = KEYEVENT_CHAR;
+		}
+		this->GetBrowser()->GetHost()->SendKeyEvent(ke);
+		break;
+	case MESSAGE_TYPE_SCROLLBARS:
+		this->GetClient()->SetScrollbars(this->GetBrowser(), msg.scrollbars.show);
+		break;
+	case MESSAGE_TYPE_ZOOM:
+		this->GetClient()->SetZoom(this->GetBrowser(), msg.zoom.zoom);
+		break;
+	case MESSAGE_TYPE_SCROLL:
+		this->GetClient()->SetScroll(
+		    this->GetBrowser(), msg.scroll.vertical, msg.scroll.horizontal);
+		break;
+	case MESSAGE_TYPE_ACTIVE_STATE_CHANGE:
+		this->UpdateActiveStateJS(msg.active_state.active);
+		break;
+	case MESSAGE_TYPE_VISIBILITY_CHANGE:
+		this->UpdateVisibilityStateJS(msg.visibility.visible);
+		break;
+	case MESSAGE_TYPE_CONFIG:
+		this->ConfigChanged(msg.config, command.url, command.css, command.js);
+		break;
+	case MESSAGE_TYPE_SUSPEND:
+		this->Suspend(msg.suspend.suspended);
+		break;
+	}
+}
+
+/* a hidden browser stops rendering. Resuming asks for a fresh frame right
+ * away instead of waiting for the page to change. */
+void BrowserInstance::Suspend(bool suspended)
+{
+	CefRefPtr<CefBrowserHost> host = browser->GetHost();
+	client->SetSuspended(browser, suspended);
+	host->WasHidden(suspended);
+	if (!suspended)
+		host->Invalidate(PET_VIEW);
+}
+
+// CEF builds without external begin frames keep painting on their own timer
+void BrowserInstance::BeginFrame()
+{
+#if BC_EXTERNAL_BEGIN_FRAME
+	if (beginFrame)
+		browser->GetHost()->SendExternalBeginFrame();
+#endif
+}
+
+void BrowserInstance::SizeChanged()
+{
+	shared_lock(&data->mutex);
+	width = data->width;
+	height = data->height;
+	pthread_mutex_unlock(&data->mutex);
+
+	// not under the mutex, WasResized asks GetViewRect right away
+	browser->GetHost()->WasResized();
+}
+
+void BrowserInstance::FpsChanged()
+{
+	shared_lock(&data->mutex);
+	fps = data->fps;
+	fpsIdle = data->fps_idle;
+	pthread_mutex_unlock(&data->mutex);
+
+	client->SetFrameRates(browser, fps, fpsIdle);
+}
+
+void BrowserInstance::UrlChanged(std::string url)
+{
+	CefString cef_url;
+	cef_url.FromString(url);
+	browser->GetMainFrame()->LoadURL(cef_url);
+	WatchUrl(url);
+}
+
+// reload local files whenever they change on disk
+void BrowserInstance::WatchUrl(const std::string& url)
+{
+	if (in_wd >= 0) {
+		app.UnwatchFile(in_wd, id);
+		in_wd = -1;
+	}
+
+	if (beginsWith(url, "file:///")) {
+		in_wd = app.WatchFile(url.substr(8), id);
+	}
+}
+
+void BrowserInstance::CssChanged(std::string css)
+{
+	this->css = css;
+	this->client->ChangeCss(this->css);
+}
+
+void BrowserInstance::JsChanged(std::string js)
+{
+	this->js = js;
+	this->client->ChangeJs(this->js);
+}
+
+void BrowserInstance::ConfigChanged(const struct browser_message_config& config,
+                                    const std::string& url, const std::string& css,
+                                    const std::string& js)
+{
+	if (config.changed & BROWSER_CONFIG_CSS)
+		this->CssChanged(css);
+	if (config.changed & BROWSER_CONFIG_JS)
+		this->JsChanged(js);
+	client->StoreViewState(config);
+
+	/* a new page picks up css, js and the view settings once it has loaded,
+	 * so it is loaded exactly once and nothing is applied twice */
+	if (config.changed & BROWSER_CONFIG_URL)
+		this->UrlChanged(url);
+	else if (config.changed
+	         & (BROWSER_CONFIG_SCROLLBARS | BROWSER_CONFIG_ZOOM | BROWSER_CONFIG_SCROLL))
+		client->ApplyViewState(browser);
+
+	__atomic_store_n(&data->config_version, config.version, __ATOMIC_RELEASE);
+}
+
+void BrowserInstance::ReloadPage()
+{
+	browser->ReloadIgnoreCache();
+}
+
+void BrowserInstance::UpdateActiveStateJS(bool active)
+{
+	CefRefPtr<CefProcessMessage> msg{CefProcessMessage::Create("Active")};
+	msg->GetArgumentList()->SetBool(0, active);
+	this->browser->SendProcessMessage(PID_BROWSER, msg);
+}
+
+void BrowserInstance::UpdateVisibilityStateJS(bool visible)
+{
+	CefRefPtr<CefProcessMessage> msg = CefProcessMessage::Create("Visibility");
+	CefRefPtr<CefListValue> args = msg->GetArgumentList();
+	args->SetBool(0, visible);
+	this->browser->SendProcessMessage(PID_BROWSER, msg);
+}
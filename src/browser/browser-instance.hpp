@@ -0,0 +1,144 @@
+/*
+Copyright (C) 2017 by Azat Khasanshin <azat.khasanshin@gmail.com>
+Copyright (C) 2018 by Adrian Schollmeyer <nexadn@yandex.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <cef_browser.h>
+#include <cef_request_context.h>
+
+#include "browser-client.hpp"
+#include "shared.h"
+
+class BrowserApp;
+
+/* the browser of one source together with the segment, rings and lanes it
+ * is fed through. A browser process started for a single source holds one of
+ * these, the shared host one per attached source. */
+class BrowserInstance : public virtual CefBaseRefCounted {
+public:
+	// takes over fds, see SHARED_IPC_MAX_FDS
+	BrowserInstance(uint32_t id, const int* fds, BrowserApp& app);
+	~BrowserInstance();
+
+	bool IsValid() const
+	{
+		return data != nullptr;
+	}
+	uint32_t GetId() const
+	{
+		return id;
+	}
+	const std::string& GetCacheName() const
+	{
+		return cacheName;
+	}
+	CefRefPtr<BrowserClient> GetClient()
+	{
+		return client;
+	}
+	CefRefPtr<CefBrowser> GetBrowser()
+	{
+		return browser;
+	}
+
+	// UI thread only
+	void Start(CefRefPtr<CefRequestContext> context);
+	void Close(std::function<void()> closed);
+	void RunLanes();
+	void ReloadPage();
+	void Heartbeat();
+
+	// stops reading the command ring, returns once the message thread is gone
+	void StopMessages();
+
+	void SizeChanged();
+	void FpsChanged();
+	void UrlChanged(std::string url);
+	void CssChanged(std::string css);
+	void JsChanged(std::string js);
+	void ConfigChanged(const struct browser_message_config& config, const std::string& url,
+	                   const std::string& css, const std::string& js);
+	void UpdateActiveStateJS(bool active);
+	void UpdateVisibilityStateJS(bool visible);
+	void Suspend(bool suspended);
+	void BeginFrame();
+
+private:
+	// a message taken off the ring, with the texts of its blobs already copied
+	// out
+	struct Command {
+		browser_message_t msg;
+		std::string url;
+		std::string css;
+		std::string js;
+	};
+
+	std::string ReadStartup(struct browser_message_config& view);
+	bool ReadBlob(uint64_t offset, uint32_t generation, std::string& text);
+	bool MapBlobs(size_t size);
+	void WatchUrl(const std::string& url);
+
+	bool Receiving() const;
+	bool ReceiveMessage(browser_message_t& msg, bool wait);
+	bool ReadCommand(const browser_message_t& msg, Command& command);
+	void MessageThreadWorker();
+	void DispatchCommand(const Command& command);
+
+	uint32_t id;
+	CefRefPtr<CefBrowser> browser;
+	CefRefPtr<BrowserClient> client;
+	std::thread messageThread;
+	bool stopping{false};
+	// see shared_data_t::owner
+	uint32_t owner{0};
+	uint32_t width;
+	uint32_t height;
+	int fps;
+	int fpsIdle;
+	// paints are driven by MESSAGE_TYPE_BEGIN_FRAME instead of CEF's timer
+	bool beginFrame{false};
+	int fd{-1};
+	int doorbell{-1};
+	// wakes the message thread for StopMessages
+	int wakeup{-1};
+	uint8_t messageBuffer[MAX_MESSAGE_SIZE];
+	// commands waiting for the UI thread, input goes first
+	std::mutex laneMutex;
+	std::deque<Command> inputLane;
+	std::deque<Command> controlLane;
+	bool lanesPosted{false};
+	int blobFd{-1};
+	int statusDoorbell{-1};
+	uint8_t* blobs{nullptr};
+	size_t blobsSize{0};
+	shared_data_t* data{nullptr};
+	std::string cacheName;
+	std::string css;
+	std::string js;
+	// the process's app, which outlives every instance
+	BrowserApp& app;
+	// the file watch taken out with BrowserApp::WatchFile, UI thread only
+	int in_wd{-1};
+
+	IMPLEMENT_REFCOUNTING(BrowserInstance);
+};
@@ -20,6 +20,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 int main(int argc, char* argv[])
 {
-	CefRefPtr<BrowserApp> app{new BrowserApp(nullptr)};
+	CefRefPtr<BrowserApp> app{new BrowserApp(-1)};
 	return CefExecuteProcess({argc, argv}, app.get(), nullptr);
 }
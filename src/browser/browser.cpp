@@ -20,12 +20,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/prctl.h>
 #include <unistd.h>
 
+#include <cstdlib>
+
 #include <cef_app.h>
 
 #include "browser-app.hpp"
 
-/* first argument is full path to the binary
- * second is shared memory id */
+/* first argument is the plugin data directory, second the cache name of the
+ * source, empty for the shared host and pooled browsers, and third the
+ * browser's end of the socketpair sources attach over, see shared_attach_t */
 int main(int argc, char* argv[])
 {
 	/* shutdown if parent process dies */
@@ -36,10 +39,14 @@ int main(int argc, char* argv[])
 	std::string resources_dir{data_dir + "/cef"};
 	std::string locales_dir{resources_dir + "/locales"};
 	std::string home_dir{getpwuid(getuid())->pw_dir};
-	std::string cache_dir{home_dir + "/.cache/obs-linuxbrowser/" + std::string{argv[2]}};
+	std::string caches_dir{home_dir + "/.cache/obs-linuxbrowser/"};
+	std::string cache_name{argv[2]};
+	/* browsers started without a source keep nothing on disk themselves */
+	std::string cache_dir{cache_name.empty() ? "" : caches_dir + cache_name};
 	std::string subprocess_path{std::string{argv[0]} + "-subprocess"};
 
-	CefRefPtr<BrowserApp> app{new BrowserApp(argv[2])};
+	CefRefPtr<BrowserApp> app{new BrowserApp(std::atoi(argv[3]), caches_dir, cache_name)};
+	app->ReceiveFirstAttach();
 
 	CefSettings settings;
 	CefString(&settings.browser_subprocess_path).FromString(subprocess_path);
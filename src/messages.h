@@ -0,0 +1,331 @@
+/*
+Copyright (C) 2017 by Azat Khasanshin <azat.khasanshin@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* bump whenever a message below or the shared header changes, the browser
+ * refuses to talk to a plugin of another version */
+#define BROWSER_PROTOCOL_VERSION 15
+/* exit status of a browser started by a plugin of another version */
+#define BROWSER_EXIT_PROTOCOL 3
+
+/* largest encoded message, urls, css and js go through the blob arena and
+ * messages only carry the offset and generation of their blob, see
+ * shared_blob_t */
+#define MAX_MESSAGE_SIZE 1024
+
+/* every message the plugin sends the browser and, from id 64 on, the status
+ * reports going the other way as MSG(NAME, id, name). The
+ * fields of each are listed in BROWSER_MESSAGE_FIELDS_<name>(FIELD, TEXT) as
+ * FIELD(type, name) for fixed size values, followed by TEXT(name) for each
+ * NUL-terminated string. On the wire a message is its type
+ * byte followed by the packed fields. */
+#define BROWSER_MESSAGES(MSG)                                                                      \
+	MSG(URL, 1, url)                                                                           \
+	MSG(SIZE, 2, size)                                                                         \
+	MSG(RELOAD, 3, reload)                                                                     \
+	MSG(CSS, 4, css)                                                                           \
+	MSG(MOUSE_CLICK, 5, mouse_click)                                                           \
+	MSG(MOUSE_MOVE, 6, mouse_move)                                                             \
+	MSG(MOUSE_WHEEL, 7, mouse_wheel)                                                           \
+	MSG(FOCUS, 8, focus)                                                                       \
+	MSG(KEY, 9, key)                                                                           \
+	MSG(SCROLLBARS, 10, scrollbars)                                                            \
+	MSG(ZOOM, 11, zoom)                                                                        \
+	MSG(SCROLL, 12, scroll)                                                                    \
+	MSG(ACTIVE_STATE_CHANGE, 13, active_state)                                                 \
+	MSG(VISIBILITY_CHANGE, 14, visibility)                                                     \
+	MSG(JS, 16, js)                                                                            \
+	MSG(CONFIG, 17, config)                                                                    \
+	MSG(SUSPEND, 18, suspend)                                                                  \
+	MSG(FPS, 19, fps)                                                                          \
+	MSG(BEGIN_FRAME, 20, begin_frame)                                                          \
+	MSG(LOAD_START, 64, load_start)                                                            \
+	MSG(LOAD_END, 65, load_end)                                                                \
+	MSG(LOAD_ERROR, 66, load_error)                                                            \
+	MSG(RENDER_TERMINATED, 67, render_terminated)                                              \
+	MSG(PAINT_STATS, 68, paint_stats)
+
+#define BROWSER_MESSAGE_FIELDS_url(FIELD, TEXT)                                                    \
+	FIELD(uint64_t, offset)                                                                    \
+	FIELD(uint32_t, blob)
+#define BROWSER_MESSAGE_FIELDS_size(FIELD, TEXT)
+#define BROWSER_MESSAGE_FIELDS_reload(FIELD, TEXT)
+#define BROWSER_MESSAGE_FIELDS_css(FIELD, TEXT)                                                    \
+	FIELD(uint64_t, offset)                                                                    \
+	FIELD(uint32_t, blob)
+#define BROWSER_MESSAGE_FIELDS_mouse_click(FIELD, TEXT)                                            \
+	FIELD(int32_t, x)                                                                          \
+	FIELD(int32_t, y)                                                                          \
+	FIELD(uint32_t, modifiers)                                                                 \
+	FIELD(int32_t, button_type)                                                                \
+	FIELD(bool, mouse_up)                                                                      \
+	FIELD(uint32_t, click_count)
+#define BROWSER_MESSAGE_FIELDS_mouse_move(FIELD, TEXT)                                             \
+	FIELD(int32_t, x)                                                                          \
+	FIELD(int32_t, y)                                                                          \
+	FIELD(uint32_t, modifiers)                                                                 \
+	FIELD(bool, mouse_leave)
+#define BROWSER_MESSAGE_FIELDS_mouse_wheel(FIELD, TEXT)                                            \
+	FIELD(int32_t, x)                                                                          \
+	FIELD(int32_t, y)                                                                          \
+	FIELD(uint32_t, modifiers)                                                                 \
+	FIELD(int32_t, x_delta)                                                                    \
+	FIELD(int32_t, y_delta)
+#define BROWSER_MESSAGE_FIELDS_focus(FIELD, TEXT) FIELD(bool, focus)
+#define BROWSER_MESSAGE_FIELDS_key(FIELD, TEXT)                                                    \
+	FIELD(bool, key_up)                                                                        \
+	FIELD(uint32_t, native_vkey)                                                               \
+	FIELD(uint32_t, modifiers)                                                                 \
+	FIELD(char, chr)
+#define BROWSER_MESSAGE_FIELDS_scrollbars(FIELD, TEXT) FIELD(bool, show)
+#define BROWSER_MESSAGE_FIELDS_zoom(FIELD, TEXT) FIELD(uint32_t, zoom)
+#define BROWSER_MESSAGE_FIELDS_scroll(FIELD, TEXT)                                                 \
+	FIELD(uint32_t, vertical)                                                                  \
+	FIELD(uint32_t, horizontal)
+#define BROWSER_MESSAGE_FIELDS_active_state(FIELD, TEXT) FIELD(bool, active)
+#define BROWSER_MESSAGE_FIELDS_visibility(FIELD, TEXT) FIELD(bool, visible)
+#define BROWSER_MESSAGE_FIELDS_js(FIELD, TEXT)                                                     \
+	FIELD(uint64_t, offset)                                                                    \
+	FIELD(uint32_t, blob)
+/* a batch of settings applied at once, changed holds the BROWSER_CONFIG_*
+ * bits of the fields that carry a value */
+#define BROWSER_MESSAGE_FIELDS_config(FIELD, TEXT)                                                 \
+	FIELD(uint32_t, version)                                                                   \
+	FIELD(uint32_t, changed)                                                                   \
+	FIELD(bool, scrollbars)                                                                    \
+	FIELD(uint32_t, zoom)                                                                      \
+	FIELD(uint32_t, scroll_vertical)                                                           \
+	FIELD(uint32_t, scroll_horizontal)                                                         \
+	FIELD(uint64_t, url_offset)                                                                \
+	FIELD(uint32_t, url_blob)                                                                  \
+	FIELD(uint64_t, css_offset)                                                                \
+	FIELD(uint32_t, css_blob)                                                                  \
+	FIELD(uint64_t, js_offset)                                                                 \
+	FIELD(uint32_t, js_blob)
+/* a suspended browser is hidden from CEF and neither paints nor copies */
+#define BROWSER_MESSAGE_FIELDS_suspend(FIELD, TEXT) FIELD(bool, suspended)
+/* like size the new frame rate is read from the header */
+#define BROWSER_MESSAGE_FIELDS_fps(FIELD, TEXT)
+/* asks a browser started with begin_frame set for one paint */
+#define BROWSER_MESSAGE_FIELDS_begin_frame(FIELD, TEXT)
+
+/* main frame loads, http_status is 0 for pages not loaded over http */
+#define BROWSER_MESSAGE_FIELDS_load_start(FIELD, TEXT)
+#define BROWSER_MESSAGE_FIELDS_load_end(FIELD, TEXT) FIELD(int32_t, http_status)
+#define BROWSER_MESSAGE_FIELDS_load_error(FIELD, TEXT) FIELD(int32_t, error_code)
+/* the render process died with a cef_termination_status_t */
+#define BROWSER_MESSAGE_FIELDS_render_terminated(FIELD, TEXT) FIELD(int32_t, status)
+/* paints over the last interval_ms and how long copying them took, fps is
+ * the rate CEF currently renders at */
+#define BROWSER_MESSAGE_FIELDS_paint_stats(FIELD, TEXT)                                            \
+	FIELD(uint32_t, interval_ms)                                                               \
+	FIELD(uint32_t, paints)                                                                    \
+	FIELD(uint32_t, copy_avg_us)                                                               \
+	FIELD(uint32_t, copy_max_us)                                                               \
+	FIELD(uint32_t, fps)
+
+#define BROWSER_CONFIG_URL 0x1
+#define BROWSER_CONFIG_CSS 0x2
+#define BROWSER_CONFIG_JS 0x4
+#define BROWSER_CONFIG_SCROLLBARS 0x8
+#define BROWSER_CONFIG_ZOOM 0x10
+#define BROWSER_CONFIG_SCROLL 0x20
+#define BROWSER_CONFIG_ALL 0x3f
+
+/* MESSAGE_TYPE_URL, MESSAGE_TYPE_SIZE, ... */
+#define BROWSER_MESSAGE_ENUM(NAME, id, name) MESSAGE_TYPE_##NAME = id,
+enum browser_message_type { BROWSER_MESSAGES(BROWSER_MESSAGE_ENUM) };
+#undef BROWSER_MESSAGE_ENUM
+
+/* decoded messages, text points into the buffer the message was decoded
+ * from */
+#define BROWSER_MESSAGE_FIELD_DECL(type, name) type name;
+#define BROWSER_MESSAGE_TEXT_DECL(name) const char* name;
+#define BROWSER_MESSAGE_STRUCT(NAME, id, name)                                                     \
+	struct browser_message_##name {                                                            \
+		uint8_t type;                                                                      \
+		BROWSER_MESSAGE_FIELDS_##name(BROWSER_MESSAGE_FIELD_DECL,                          \
+		                              BROWSER_MESSAGE_TEXT_DECL)                           \
+	};
+BROWSER_MESSAGES(BROWSER_MESSAGE_STRUCT)
+#undef BROWSER_MESSAGE_STRUCT
+#undef BROWSER_MESSAGE_FIELD_DECL
+#undef BROWSER_MESSAGE_TEXT_DECL
+
+#define BROWSER_MESSAGE_MEMBER(NAME, id, name) struct browser_message_##name name;
+typedef union {
+	uint8_t type;
+	BROWSER_MESSAGES(BROWSER_MESSAGE_MEMBER)
+} browser_message_t;
+#undef BROWSER_MESSAGE_MEMBER
+
+/* browser_encode_<name>(wire, wire_size, fields...) writes the message into
+ * wire and returns its size, or 0 if it does not fit into wire_size bytes */
+#define BROWSER_MESSAGE_FIELD_PARAM(type, name) , type name
+#define BROWSER_MESSAGE_TEXT_PARAM(name) , const char* name
+#define BROWSER_MESSAGE_FIELD_ENCODE(type, name)                                                   \
+	if (wire_size - (size_t)(pos - wire) < sizeof(type))                                       \
+		return 0;                                                                          \
+	memcpy(pos, &name, sizeof(type));                                                          \
+	pos += sizeof(type);
+#define BROWSER_MESSAGE_TEXT_ENCODE(name)                                                          \
+	if (wire_size - (size_t)(pos - wire) < strlen(name) + 1)                                   \
+		return 0;                                                                          \
+	memcpy(pos, name, strlen(name) + 1);                                                       \
+	pos += strlen(name) + 1;
+#define BROWSER_MESSAGE_PARAMS(name)                                                               \
+	BROWSER_MESSAGE_FIELDS_##name(BROWSER_MESSAGE_FIELD_PARAM, BROWSER_MESSAGE_TEXT_PARAM)
+#define BROWSER_MESSAGE_ENCODER(NAME, id, name)                                                    \
+	static inline size_t browser_encode_##name(                                                \
+	    uint8_t* wire, size_t wire_size BROWSER_MESSAGE_PARAMS(name))                          \
+	{                                                                                          \
+		uint8_t* pos = wire;                                                               \
+		if (wire_size < 1)                                                                 \
+			return 0;                                                                  \
+		*pos++ = MESSAGE_TYPE_##NAME;                                                      \
+		BROWSER_MESSAGE_FIELDS_##name(BROWSER_MESSAGE_FIELD_ENCODE,                        \
+		                              BROWSER_MESSAGE_TEXT_ENCODE)                         \
+		return pos - wire;                                                                 \
+	}
+BROWSER_MESSAGES(BROWSER_MESSAGE_ENCODER)
+#undef BROWSER_MESSAGE_ENCODER
+#undef BROWSER_MESSAGE_PARAMS
+#undef BROWSER_MESSAGE_FIELD_PARAM
+#undef BROWSER_MESSAGE_TEXT_PARAM
+#undef BROWSER_MESSAGE_FIELD_ENCODE
+#undef BROWSER_MESSAGE_TEXT_ENCODE
+
+/* fills msg from the size bytes at buf, returns false for unknown or
+ * truncated messages. Text fields point into buf. */
+#define BROWSER_MESSAGE_FIELD_DECODE(type, name)                                                   \
+	if ((size_t)(end - p) < sizeof(type))                                                      \
+		return false;                                                                      \
+	memcpy(&m->name, p, sizeof(type));                                                         \
+	p += sizeof(type);
+#define BROWSER_MESSAGE_TEXT_DECODE(name)                                                          \
+	m->name = (const char*) p;                                                                 \
+	p = (const uint8_t*) memchr(p, '\0', end - p);                                             \
+	if (!p)                                                                                    \
+		return false;                                                                      \
+	p++;
+#define BROWSER_MESSAGE_DECODE_CASE(NAME, id, name)                                                \
+	case MESSAGE_TYPE_##NAME: {                                                                \
+		struct browser_message_##name* m = &msg->name;                                     \
+		(void) m;                                                                          \
+		BROWSER_MESSAGE_FIELDS_##name(BROWSER_MESSAGE_FIELD_DECODE,                        \
+		                              BROWSER_MESSAGE_TEXT_DECODE)                         \
+		return true;                                                                       \
+	}
+static inline bool browser_decode_message(const uint8_t* buf, size_t size, browser_message_t* msg)
+{
+	const uint8_t* p = buf;
+	const uint8_t* end = buf + size;
+	if (size < 1)
+		return false;
+
+	msg->type = *p++;
+	switch (msg->type) {
+		BROWSER_MESSAGES(BROWSER_MESSAGE_DECODE_CASE)
+	}
+	return false;
+}
+#undef BROWSER_MESSAGE_DECODE_CASE
+#undef BROWSER_MESSAGE_FIELD_DECODE
+#undef BROWSER_MESSAGE_TEXT_DECODE
+
+/* browser_encode_message(wire, wire_size, msg) encodes an already filled in
+ * message, see browser_encode_<name> */
+#define BROWSER_MESSAGE_FIELD_ENCODE(type, name)                                                   \
+	if (wire_size - (size_t)(pos - wire) < sizeof(type))                                       \
+		return 0;                                                                          \
+	memcpy(pos, &m->name, sizeof(type));                                                       \
+	pos += sizeof(type);
+#define BROWSER_MESSAGE_TEXT_ENCODE(name)                                                          \
+	if (wire_size - (size_t)(pos - wire) < strlen(m->name) + 1)                                \
+		return 0;                                                                          \
+	memcpy(pos, m->name, strlen(m->name) + 1);                                                 \
+	pos += strlen(m->name) + 1;
+#define BROWSER_MESSAGE_ENCODE_CASE(NAME, id, name)                                                \
+	case MESSAGE_TYPE_##NAME: {                                                                \
+		const struct browser_message_##name* m = &msg->name;                               \
+		(void) m;                                                                          \
+		BROWSER_MESSAGE_FIELDS_##name(BROWSER_MESSAGE_FIELD_ENCODE,                        \
+		                              BROWSER_MESSAGE_TEXT_ENCODE)                         \
+		return pos - wire;                                                                 \
+	}
+static inline size_t browser_encode_message(uint8_t* wire, size_t wire_size,
+                                            const browser_message_t* msg)
+{
+	uint8_t* pos = wire;
+	if (wire_size < 1)
+		return 0;
+
+	*pos++ = msg->type;
+	switch (msg->type) {
+		BROWSER_MESSAGES(BROWSER_MESSAGE_ENCODE_CASE)
+	}
+	return 0;
+}
+#undef BROWSER_MESSAGE_ENCODE_CASE
+#undef BROWSER_MESSAGE_FIELD_ENCODE
+#undef BROWSER_MESSAGE_TEXT_ENCODE
+
+/* whether a message may be merged into the one queued right before it */
+static inline bool browser_message_coalescable(const browser_message_t* msg)
+{
+	return msg->type == MESSAGE_TYPE_MOUSE_MOVE || msg->type == MESSAGE_TYPE_MOUSE_WHEEL
+	       || msg->type == MESSAGE_TYPE_BEGIN_FRAME;
+}
+
+/* merge next into prev when delivering only the result is equivalent: mouse
+ * moves with the same modifiers and leave flag collapse to the newest
+ * position, wheel events with the same modifiers add up their deltas and
+ * frame requests the browser did not get to yet make one. Returns false if
+ * both have to be delivered in order. */
+static inline bool browser_coalesce_message(browser_message_t* prev,
+                                            const browser_message_t* next)
+{
+	if (prev->type != next->type)
+		return false;
+
+	switch (prev->type) {
+	case MESSAGE_TYPE_BEGIN_FRAME:
+		return true;
+	case MESSAGE_TYPE_MOUSE_MOVE:
+		/* a leave and the move after it are the page's mouseleave and
+		 * mouseenter */
+		if (prev->mouse_move.mouse_leave != next->mouse_move.mouse_leave
+		    || prev->mouse_move.modifiers != next->mouse_move.modifiers)
+			return false;
+		prev->mouse_move = next->mouse_move;
+		return true;
+	case MESSAGE_TYPE_MOUSE_WHEEL:
+		if (prev->mouse_wheel.modifiers != next->mouse_wheel.modifiers)
+			return false;
+		prev->mouse_wheel.x = next->mouse_wheel.x;
+		prev->mouse_wheel.y = next->mouse_wheel.y;
+		prev->mouse_wheel.x_delta += next->mouse_wheel.x_delta;
+		prev->mouse_wheel.y_delta += next->mouse_wheel.y_delta;
+		return true;
+	}
+	return false;
+}
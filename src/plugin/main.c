@@ -18,7 +18,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <obs-module.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+#include <util/threading.h>
 
+#include "config.h"
 #include "manager.h"
 #include "windows_keycode.h"
 
@@ -31,6 +35,9 @@ struct browser_data {
 	uint32_t width;
 	uint32_t height;
 	uint32_t fps;
+	uint32_t fps_preview;
+	uint32_t fps_offscreen;
+	uint32_t fps_idle;
 	char* css_file;
 	char* js_file;
 	bool hide_scrollbars;
@@ -38,24 +45,134 @@ struct browser_data {
 	uint32_t scroll_vertical;
 	uint32_t scroll_horizontal;
 	bool reload_on_scene;
-	bool stop_on_hide;
+	uint32_t hide_action;
+	uint32_t suspend_timeout;
+	bool async_fifo;
+	bool begin_frame;
+	uint32_t frame_wait_us;
 
 	/* internal data */
 	obs_source_t* source;
 	obs_data_t* settings;
 	gs_texture_t* activeTexture;
+	uint64_t texture_generation;
 	pthread_mutex_t textureLock;
 	browser_manager_t* manager;
 
+	/* async sources hand timestamped frames to OBS from their own thread
+	 * instead of uploading a texture every tick */
+	bool async;
+	bool async_active;
+	pthread_t async_thread;
+
 	obs_hotkey_id reload_page_key;
+
+	/* whether the source is on program or shown anywhere, which picks
+	 * the frame rate */
+	bool active;
+	bool showing;
+
+	/* when the source was hidden and whether that stopped the browser */
+	uint64_t hidden_ns;
+	bool hide_stopped;
+
+	/* what the browser last reported, written by the manager's status
+	 * thread */
+	pthread_mutex_t status_lock;
+	bool loading;
+	uint64_t load_start_ns;
+	int32_t http_status;
+	int32_t load_error;
+	bool painting;
+	double paint_fps;
+	uint32_t render_fps;
+	uint32_t copy_avg_us;
+	uint32_t copy_max_us;
 };
 
+/* what happens to the browser of a hidden source */
+#define HIDE_ACTION_KEEP 0
+#define HIDE_ACTION_SUSPEND 1
+#define HIDE_ACTION_STOP 2
+
+/* loads taking longer than this are logged */
+#define SLOW_LOAD_NS (5 * 1000000000ULL)
+
 static const char* browser_get_name(void* unused)
 {
 	UNUSED_PARAMETER(unused);
 	return obs_module_text("LinuxBrowser");
 }
 
+static const char* browser_get_name_async(void* unused)
+{
+	UNUSED_PARAMETER(unused);
+	return obs_module_text("LinuxBrowserAsync");
+}
+
+/* the full rate while on program, less while the source is only shown
+ * somewhere else like the studio mode preview, and hardly anything while it
+ * is in no visible scene */
+static void update_frame_rate(struct browser_data* data)
+{
+	uint32_t fps = data->fps;
+	if (!data->active && data->showing && data->fps_preview < fps)
+		fps = data->fps_preview;
+	else if (!data->active && !data->showing && data->fps_offscreen < fps)
+		fps = data->fps_offscreen;
+	browser_manager_set_fps(data->manager, fps, data->fps_idle);
+}
+
+static void browser_status(void* vptr, const browser_message_t* msg)
+{
+	struct browser_data* data = vptr;
+	const char* name = obs_source_get_name(data->source);
+
+	pthread_mutex_lock(&data->status_lock);
+	switch (msg->type) {
+	case MESSAGE_TYPE_LOAD_START:
+		data->loading = true;
+		data->load_error = 0;
+		data->load_start_ns = os_gettime_ns();
+		break;
+	case MESSAGE_TYPE_LOAD_END: {
+		uint64_t load_ns = os_gettime_ns() - data->load_start_ns;
+		data->loading = false;
+		data->http_status = msg->load_end.http_status;
+		if (data->http_status >= 400)
+			blog(LOG_WARNING, "%s: page loaded with HTTP status %d", name,
+			     data->http_status);
+		if (load_ns > SLOW_LOAD_NS)
+			blog(LOG_WARNING, "%s: page took %.1f s to load", name, load_ns / 1e9);
+		break;
+	}
+	case MESSAGE_TYPE_LOAD_ERROR:
+		data->loading = false;
+		data->load_error = msg->load_error.error_code;
+		blog(LOG_WARNING, "%s: page failed to load, error %d", name, data->load_error);
+		break;
+	case MESSAGE_TYPE_RENDER_TERMINATED:
+		blog(LOG_WARNING, "%s: render process terminated with status %d, reloading", name,
+		     msg->render_terminated.status);
+		break;
+	case MESSAGE_TYPE_PAINT_STATS: {
+		const struct browser_message_paint_stats* stats = &msg->paint_stats;
+		data->painting = true;
+		data->paint_fps =
+		    stats->interval_ms ? stats->paints * 1000.0 / stats->interval_ms : 0.0;
+		data->copy_avg_us = stats->copy_avg_us;
+		data->copy_max_us = stats->copy_max_us;
+		data->render_fps = stats->fps;
+		break;
+	}
+	}
+	pthread_mutex_unlock(&data->status_lock);
+
+	/* the browser itself is fine, the page only needs to come back */
+	if (msg->type == MESSAGE_TYPE_RENDER_TERMINATED)
+		browser_manager_reload_page(data->manager);
+}
+
 /* update stored parameters, see if they have changed and call
  * browser_manager methods based on that */
 static void browser_update(void* vptr, obs_data_t* settings)
@@ -68,12 +185,23 @@ static void browser_update(void* vptr, obs_data_t* settings)
 	data->width = width;
 	data->height = height;
 	data->fps = obs_data_get_int(settings, "fps");
+	data->fps_preview = obs_data_get_int(settings, "fps_preview");
+	data->fps_offscreen = obs_data_get_int(settings, "fps_offscreen");
+	data->fps_idle = obs_data_get_int(settings, "fps_idle");
 	bool hide_scrollbars = obs_data_get_bool(settings, "hide_scrollbars");
 	uint32_t zoom = obs_data_get_int(settings, "zoom");
 	uint32_t scroll_vertical = obs_data_get_int(settings, "scroll_vertical");
 	uint32_t scroll_horizontal = obs_data_get_int(settings, "scroll_horizontal");
 	data->reload_on_scene = obs_data_get_bool(settings, "reload_on_scene");
-	data->stop_on_hide = obs_data_get_bool(settings, "stop_on_hide");
+	data->hide_action = obs_data_get_int(settings, "hide_action");
+	/* sources saved before hide_action existed */
+	if (!obs_data_has_user_value(settings, "hide_action")
+	    && obs_data_get_bool(settings, "stop_on_hide"))
+		data->hide_action = HIDE_ACTION_STOP;
+	data->suspend_timeout = obs_data_get_int(settings, "suspend_timeout");
+	data->frame_wait_us = obs_data_get_int(settings, "frame_wait_us");
+	/* older CEF builds can not take begin frames from outside */
+	data->begin_frame = BC_EXTERNAL_BEGIN_FRAME && obs_data_get_bool(settings, "begin_frame");
 
 	bool is_local = obs_data_get_bool(settings, "is_local_file");
 	const char* url;
@@ -85,10 +213,25 @@ static void browser_update(void* vptr, obs_data_t* settings)
 	const char* css_file = obs_data_get_string(settings, "css_file");
 	const char* js_file = obs_data_get_string(settings, "js_file");
 
-	if (!data->manager)
+	bool created = !data->manager;
+	if (created) {
 		data->manager = create_browser_manager(data->width, data->height, data->fps,
 		                                       settings, obs_source_get_name(data->source));
+		browser_manager_set_status_callback(data->manager, browser_status, data);
+	}
+
+	bool async_fifo = data->async && obs_data_get_bool(settings, "async_fifo");
+	if (data->async_fifo != async_fifo) {
+		data->async_fifo = async_fifo;
+		pthread_mutex_lock(&data->textureLock);
+		browser_manager_set_frame_mode(data->manager,
+		                               async_fifo ? SHARED_FRAME_MODE_FIFO
+		                                          : SHARED_FRAME_MODE_LATEST);
+		pthread_mutex_unlock(&data->textureLock);
+	}
 
+	/* everything up to the commit reaches the browser as one update */
+	browser_manager_begin_update(data->manager);
 	if (data->hide_scrollbars != hide_scrollbars) {
 		data->hide_scrollbars = hide_scrollbars;
 		browser_manager_set_scrollbars(data->manager, !hide_scrollbars);
@@ -134,21 +277,30 @@ static void browser_update(void* vptr, obs_data_t* settings)
 		data->js_file = bstrdup(js_file);
 		browser_manager_change_js_file(data->manager, data->js_file);
 	}
+	browser_manager_commit_update(data->manager);
+	update_frame_rate(data);
+	/* CEF only takes it when creating the browser */
+	if (browser_manager_set_begin_frame(data->manager, data->begin_frame) && !created)
+		browser_manager_restart_browser(data->manager);
+	/* started only now so that it goes straight to the configured page */
+	if (created)
+		browser_manager_start_browser(data->manager);
 
 	/* need to recreate texture if size changed */
 	pthread_mutex_lock(&data->textureLock);
-	obs_enter_graphics();
-	if (resize || !data->activeTexture) {
-		if (resize)
-			browser_manager_change_size(data->manager, data->width, data->height);
+	if (resize)
+		browser_manager_change_size(data->manager, data->width, data->height);
+	if (!data->async && (resize || !data->activeTexture)) {
+		obs_enter_graphics();
 		if (data->activeTexture) {
 			gs_texture_destroy(data->activeTexture);
 			data->activeTexture = NULL;
 		}
 		data->activeTexture =
 		    gs_texture_create(width, height, GS_BGRA, 1, NULL, GS_DYNAMIC);
+		data->texture_generation = 0;
+		obs_leave_graphics();
 	}
-	obs_leave_graphics();
 	pthread_mutex_unlock(&data->textureLock);
 }
 
@@ -164,27 +316,106 @@ static void reload_hotkey_pressed(void* vptr, obs_hotkey_id id, obs_hotkey_t* ke
 	browser_manager_reload_page(data->manager);
 }
 
-static void* browser_create(obs_data_t* settings, obs_source_t* source)
+static void output_async_frame(struct browser_data* data, const browser_frame_t* frame)
+{
+	struct obs_source_frame out = {0};
+	out.data[0] = (uint8_t*) frame->pixels;
+	out.linesize[0] = frame->linesize;
+	out.width = data->width;
+	out.height = data->height;
+	out.timestamp = frame->timestamp;
+	out.format = VIDEO_FORMAT_BGRA;
+	out.full_range = true;
+	obs_source_output_video(data->source, &out);
+}
+
+static void* async_video_thread(void* vptr)
+{
+	struct browser_data* data = vptr;
+	os_set_thread_name("linuxbrowser-async-video");
+	uint64_t frame_ns = video_output_get_frame_time(obs_get_video());
+	uint64_t next_begin_ns = os_gettime_ns();
+
+	while (__atomic_load_n(&data->async_active, __ATOMIC_ACQUIRE)) {
+		browser_frame_t frame;
+		uint64_t timeout_ns = 100000000;
+
+		/* there is no video tick, so this asks for the paints on OBS's
+		 * frame interval instead */
+		if (__atomic_load_n(&data->begin_frame, __ATOMIC_RELAXED)) {
+			uint64_t now = os_gettime_ns();
+			if (now >= next_begin_ns) {
+				if (obs_source_showing(data->source))
+					browser_manager_request_frame(data->manager);
+				/* start over after falling behind rather than catch up */
+				if (now - next_begin_ns >= frame_ns)
+					next_begin_ns = now;
+				next_begin_ns += frame_ns;
+			}
+			timeout_ns = next_begin_ns - now;
+		}
+
+		/* in fifo mode every call hands out the next queued frame, else
+		 * the newest one again until another is painted */
+		pthread_mutex_lock(&data->textureLock);
+		while (browser_manager_get_frame(data->manager, data->width, data->height, &frame)
+		       && frame.generation != data->texture_generation) {
+			output_async_frame(data, &frame);
+			data->texture_generation = frame.generation;
+		}
+		pthread_mutex_unlock(&data->textureLock);
+
+		browser_manager_wait_frame(data->manager, timeout_ns);
+	}
+	return NULL;
+}
+
+static void* browser_create_common(obs_data_t* settings, obs_source_t* source, bool async)
 {
 	struct browser_data* data = bzalloc(sizeof(struct browser_data));
 	data->source = source;
 	data->settings = settings;
+	data->async = async;
 	pthread_mutex_init(&data->textureLock, NULL);
+	pthread_mutex_init(&data->status_lock, NULL);
 
 	browser_update(data, settings);
 
+	if (async) {
+		data->async_active = true;
+		if (pthread_create(&data->async_thread, NULL, async_video_thread, data) != 0) {
+			blog(LOG_ERROR, "failed to start async video thread");
+			data->async_active = false;
+		}
+	}
+
 	data->reload_page_key =
 	    obs_hotkey_register_source(source, "linuxbrowser.reloadpage",
 	                               obs_module_text("ReloadPage"), reload_hotkey_pressed, data);
 	return data;
 }
 
+static void* browser_create(obs_data_t* settings, obs_source_t* source)
+{
+	return browser_create_common(settings, source, false);
+}
+
+static void* browser_create_async(obs_data_t* settings, obs_source_t* source)
+{
+	return browser_create_common(settings, source, true);
+}
+
 static void browser_destroy(void* vptr)
 {
 	struct browser_data* data = vptr;
 	if (!data)
 		return;
 
+	if (data->async_active) {
+		__atomic_store_n(&data->async_active, false, __ATOMIC_RELEASE);
+		pthread_join(data->async_thread, NULL);
+	}
+
 	pthread_mutex_destroy(&data->textureLock);
 	if (data->activeTexture) {
 		obs_enter_graphics();
@@ -197,6 +428,7 @@ static void browser_destroy(void* vptr)
 		destroy_browser_manager(data->manager);
 		data->manager = NULL;
 	}
+	pthread_mutex_destroy(&data->status_lock);
 
 	obs_hotkey_unregister(data->reload_page_key);
 
@@ -279,12 +511,6 @@ static bool restart_button_clicked(obs_properties_t* props, obs_property_t* prop
 	UNUSED_PARAMETER(property);
 	struct browser_data* data = vptr;
 	browser_manager_restart_browser(data->manager);
-	browser_manager_change_css_file(data->manager, data->css_file);
-	browser_manager_change_js_file(data->manager, data->js_file);
-	browser_manager_change_url(data->manager, data->url);
-	browser_manager_set_scrollbars(data->manager, !data->hide_scrollbars);
-	browser_manager_set_zoom(data->manager, data->zoom);
-	browser_manager_set_scroll(data->manager, data->scroll_vertical, data->scroll_horizontal);
 	return true;
 }
 
@@ -302,10 +528,43 @@ static bool is_local_file_modified(obs_properties_t* props, obs_property_t* prop
 	return true;
 }
 
+/* a read-only line with what the browser last reported */
+static void add_status_property(obs_properties_t* props, struct browser_data* data)
+{
+	struct dstr status = {0};
+
+	dstr_printf(&status, "%s: ", obs_module_text("Status"));
+	pthread_mutex_lock(&data->status_lock);
+	if (data->loading)
+		dstr_cat(&status, obs_module_text("StatusLoading"));
+	else if (data->load_error)
+		dstr_catf(&status, "%s (%d)", obs_module_text("StatusFailed"), data->load_error);
+	else if (data->http_status)
+		dstr_catf(&status, "%s (HTTP %d)", obs_module_text("StatusLoaded"),
+		          data->http_status);
+	else
+		dstr_cat(&status, obs_module_text("StatusStarting"));
+	if (data->painting)
+		dstr_catf(&status, ", %.1f of %u fps, %.2f / %.2f ms copy", data->paint_fps,
+		          data->render_fps, data->copy_avg_us / 1000.0,
+		          data->copy_max_us / 1000.0);
+	pthread_mutex_unlock(&data->status_lock);
+	uint32_t crashes = data->manager ? browser_manager_get_crashes(data->manager) : 0;
+	if (crashes)
+		dstr_catf(&status, ", %s: %u", obs_module_text("Crashes"), crashes);
+
+	obs_property_t* prop =
+	    obs_properties_add_text(props, "status", status.array, OBS_TEXT_DEFAULT);
+	obs_property_set_enabled(prop, false);
+	dstr_free(&status);
+}
+
 static obs_properties_t* browser_get_properties(void* vptr)
 {
-	UNUSED_PARAMETER(vptr);
+	struct browser_data* data = vptr;
 	obs_properties_t* props = obs_properties_create();
+	if (data)
+		add_status_property(props, data);
 
 	obs_property_t* prop =
 	    obs_properties_add_bool(props, "is_local_file", obs_module_text("LocalFile"));
@@ -318,6 +577,13 @@ static obs_properties_t* browser_get_properties(void* vptr)
 	obs_properties_add_int(props, "height", obs_module_text("Height"), 1, MAX_BROWSER_HEIGHT,
 	                       1);
 	obs_properties_add_int(props, "fps", obs_module_text("FPS"), 1, 60, 1);
+	obs_properties_add_int(props, "fps_preview", obs_module_text("FPSPreview"), 1, 60, 1);
+	obs_properties_add_int(props, "fps_offscreen", obs_module_text("FPSOffscreen"), 1, 60, 1);
+	obs_properties_add_int(props, "fps_idle", obs_module_text("FPSIdle"), 0, 60, 1);
+	obs_properties_add_int(props, "frame_wait_us", obs_module_text("FrameWait"), 0, 4000, 100);
+#if BC_EXTERNAL_BEGIN_FRAME
+	obs_properties_add_bool(props, "begin_frame", obs_module_text("BeginFrame"));
+#endif
 	obs_properties_add_bool(props, "hide_scrollbars", obs_module_text("HideScrollbars"));
 	obs_properties_add_int(props, "zoom", obs_module_text("Zoom"), 1, 500, 1);
 	obs_properties_add_int(props, "scroll_vertical", obs_module_text("ScrollVertical"), 0,
@@ -342,6 +608,8 @@ static obs_properties_t* browser_get_properties(void* vptr)
 	                        "*.so", NULL);
 	obs_properties_add_text(props, "flash_version", obs_module_text("FlashVersion"),
 	                        OBS_TEXT_DEFAULT);
+	obs_properties_add_bool(props, "huge_pages", obs_module_text("HugePages"));
+	obs_properties_add_bool(props, "shared_host", obs_module_text("SharedHost"));
 	obs_properties_add_editable_list(props, "cef_environment",
 	                                 obs_module_text("EnvironmentVariables"),
 	                                 OBS_EDITABLE_LIST_TYPE_STRINGS, NULL, NULL);
@@ -351,26 +619,88 @@ static obs_properties_t* browser_get_properties(void* vptr)
 
 	obs_properties_add_button(props, "restart", obs_module_text("RestartBrowser"),
 	                          restart_button_clicked);
-	obs_properties_add_bool(props, "stop_on_hide", obs_module_text("StopOnHide"));
+	prop = obs_properties_add_list(props, "hide_action", obs_module_text("HideAction"),
+	                               OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, obs_module_text("HideKeep"), HIDE_ACTION_KEEP);
+	obs_property_list_add_int(prop, obs_module_text("HideSuspend"), HIDE_ACTION_SUSPEND);
+	obs_property_list_add_int(prop, obs_module_text("StopOnHide"), HIDE_ACTION_STOP);
+	obs_properties_add_int(props, "suspend_timeout", obs_module_text("SuspendTimeout"), 0,
+	                       86400, 1);
 
 	return props;
 }
 
+static obs_properties_t* browser_get_properties_async(void* vptr)
+{
+	obs_properties_t* props = browser_get_properties(vptr);
+	obs_properties_add_bool(props, "async_fifo", obs_module_text("AsyncFifo"));
+	return props;
+}
+
 static void browser_get_defaults(obs_data_t* settings)
 {
 	obs_data_set_default_string(settings, "url", "http://www.obsproject.com");
 	obs_data_set_default_int(settings, "width", 800);
 	obs_data_set_default_int(settings, "height", 600);
 	obs_data_set_default_int(settings, "fps", 30);
+	obs_data_set_default_int(settings, "fps_preview", 10);
+	obs_data_set_default_int(settings, "fps_offscreen", 1);
+	obs_data_set_default_int(settings, "fps_idle", 10);
 	obs_data_set_default_string(settings, "flash_path", "");
 	obs_data_set_default_string(settings, "flash_version", "");
 	obs_data_set_default_int(settings, "zoom", 100);
+	obs_data_set_default_int(settings, "hide_action", HIDE_ACTION_KEEP);
+	obs_data_set_default_int(settings, "suspend_timeout", 300);
+}
+
+/* copy only the dirty rects of the frame into the texture's staging buffer,
+ * which still holds the previous upload */
+static void upload_dirty_rects(struct browser_data* data, const browser_frame_t* frame)
+{
+	uint8_t* ptr;
+	uint32_t linesize;
+	if (!gs_texture_map(data->activeTexture, &ptr, &linesize))
+		return;
+
+	for (uint32_t i = 0; i < frame->rect_count; i++) {
+		const shared_rect_t* r = &frame->rects[i];
+		if (r->x >= data->width || r->y >= data->height)
+			continue;
+		uint32_t w = r->x + r->width > data->width ? data->width - r->x : r->width;
+		uint32_t h = r->y + r->height > data->height ? data->height - r->y : r->height;
+
+		for (uint32_t y = r->y; y < r->y + h; y++)
+			memcpy(ptr + y * linesize + r->x * 4,
+			       frame->pixels + y * frame->linesize + r->x * 4, w * 4);
+	}
+
+	gs_texture_unmap(data->activeTexture);
+}
+
+/* a suspended source hidden for long enough gives up its browser */
+static void check_suspend_timeout(struct browser_data* data)
+{
+	if (data->hidden_ns && data->suspend_timeout && !data->hide_stopped
+	    && os_gettime_ns() - data->hidden_ns > data->suspend_timeout * 1000000000ULL) {
+		blog(LOG_INFO, "%s: hidden for %u s, stopping the browser",
+		     obs_source_get_name(data->source), data->suspend_timeout);
+		browser_manager_stop_browser(data->manager);
+		data->hide_stopped = true;
+	}
 }
 
 static void browser_tick(void* vptr, float seconds)
 {
 	UNUSED_PARAMETER(seconds);
 	struct browser_data* data = vptr;
+
+	check_suspend_timeout(data);
+
+	/* on OBS's clock the browser paints once per tick, shown by this one if
+	 * it makes it within frame_wait_us or else by the next */
+	if (data->begin_frame && obs_source_showing(data->source))
+		browser_manager_request_frame(data->manager);
+
 	pthread_mutex_lock(&data->textureLock);
 
 	if (!data->activeTexture || !obs_source_showing(data->source)) {
@@ -378,12 +708,19 @@ static void browser_tick(void* vptr, float seconds)
 		return;
 	}
 
-	lock_browser_manager(data->manager);
-	obs_enter_graphics();
-	gs_texture_set_image(data->activeTexture, get_browser_manager_data(data->manager),
-	                     data->width * 4, false);
-	obs_leave_graphics();
-	unlock_browser_manager(data->manager);
+	browser_frame_t frame;
+	if (browser_manager_frame_ready(data->manager, data->frame_wait_us * 1000ULL)
+	    && browser_manager_get_frame(data->manager, data->width, data->height, &frame)
+	    && frame.generation != data->texture_generation) {
+		obs_enter_graphics();
+		if (data->texture_generation == 0 || data->texture_generation < frame.damage_base)
+			gs_texture_set_image(data->activeTexture, frame.pixels, frame.linesize,
+			                     false);
+		else
+			upload_dirty_rects(data, &frame);
+		obs_leave_graphics();
+		data->texture_generation = frame.generation;
+	}
 
 	pthread_mutex_unlock(&data->textureLock);
 }
@@ -593,42 +930,69 @@ static void browser_source_activate(void* vptr)
 
 	struct browser_data* data = vptr;
 	browser_manager_send_active_state_change(data->manager, true);
+	data->active = true;
+	update_frame_rate(data);
 }
 
 static void browser_source_deactivate(void* vptr)
 {
 	struct browser_data* data = vptr;
 	browser_manager_send_active_state_change(data->manager, false);
+	data->active = false;
+	update_frame_rate(data);
+}
+
+/* frames go out from the async video thread, the tick only has to keep the
+ * hide action going */
+static void browser_tick_async(void* vptr, float seconds)
+{
+	UNUSED_PARAMETER(seconds);
+	check_suspend_timeout(vptr);
 }
 
 static void browser_source_show(void* vptr)
 {
 	struct browser_data* data = vptr;
 	browser_manager_send_visibility_change(data->manager, true);
+	data->showing = true;
+	update_frame_rate(data);
 
-	if (data->stop_on_hide) {
+	/* resumed before a restart so that the new browser starts out visible */
+	browser_manager_set_suspended(data->manager, false);
+	if (data->hide_stopped)
 		browser_manager_start_browser(data->manager);
-		browser_manager_change_css_file(data->manager, data->css_file);
-		browser_manager_change_js_file(data->manager, data->js_file);
-		browser_manager_change_url(data->manager, data->url);
-		browser_manager_set_scrollbars(data->manager, !data->hide_scrollbars);
-		browser_manager_set_zoom(data->manager, data->zoom);
-		browser_manager_set_scroll(data->manager, data->scroll_vertical,
-		                           data->scroll_horizontal);
-	}
+	data->hidden_ns = 0;
+	data->hide_stopped = false;
 }
 
 static void browser_source_hide(void* vptr)
 {
 	struct browser_data* data = vptr;
 	browser_manager_send_visibility_change(data->manager, false);
+	data->showing = false;
+	update_frame_rate(data);
 
-	if (data->stop_on_hide)
+	if (data->hide_action == HIDE_ACTION_STOP) {
 		browser_manager_stop_browser(data->manager);
+		data->hide_stopped = true;
+	} else if (data->hide_action == HIDE_ACTION_SUSPEND) {
+		browser_manager_set_suspended(data->manager, true);
+		data->hidden_ns = os_gettime_ns();
+	}
 }
 
 bool obs_module_load(void)
 {
+	browser_manager_remove_stale_segments();
+
+	/* prewarm_browsers in the plugin's config.json sets how many idle
+	 * browsers are kept around for new sources */
+	char* config_path = obs_module_config_path("config.json");
+	obs_data_t* config = obs_data_create_from_json_file_safe(config_path, "bak");
+	browser_manager_init_pool(obs_data_get_int(config, "prewarm_browsers"));
+	obs_data_release(config);
+	bfree(config_path);
+
 	struct obs_source_info info = {};
 	info.id = "linuxbrowser-source";
 	info.type = OBS_SOURCE_TYPE_INPUT;
@@ -657,5 +1021,23 @@ bool obs_module_load(void)
 	info.hide = browser_source_hide;
 
 	obs_register_source(&info);
+
+	struct obs_source_info async_info = info;
+	async_info.id = "linuxbrowser-async-source";
+	async_info.output_flags = OBS_SOURCE_ASYNC_VIDEO | OBS_SOURCE_INTERACTION;
+	async_info.get_name = browser_get_name_async;
+	async_info.create = browser_create_async;
+	async_info.get_properties = browser_get_properties_async;
+	async_info.video_tick = browser_tick_async;
+	async_info.video_render = NULL;
+	obs_register_source(&async_info);
+
 	return true;
 }
+
+void obs_module_unload(void)
+{
+	browser_manager_free_pool();
+	browser_manager_stop_launcher();
+	browser_manager_stop_reaper();
+}
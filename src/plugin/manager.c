@@ -16,29 +16,82 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <fcntl.h>
-#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
-#include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <util/platform.h>
 
 #include "manager.h"
 
-char* get_shm_name(const char* uid)
+char* get_cache_name(const char* uid)
 {
-	char* shm_name = bzalloc(SHM_MAX);
-	snprintf(shm_name, SHM_MAX, "%s-%s", SHM_NAME, uid);
+	char* cache_name = bzalloc(CACHE_NAME_MAX);
+	snprintf(cache_name, CACHE_NAME_MAX, "%s-%s", CACHE_NAME, uid);
 	// escape out '/' character
-	char* current_pos = strchr(shm_name + 1, '/');
+	char* current_pos = strchr(cache_name + 1, '/');
 	while (current_pos) {
 		*current_pos = '|';
 		current_pos = strchr(current_pos, '/');
 	}
-	return shm_name;
+	return cache_name;
+}
+
+/* older versions kept frames in named shm segments which stayed behind in
+ * /dev/shm whenever OBS crashed */
+void browser_manager_remove_stale_segments(void)
+{
+	DIR* dir = opendir("/dev/shm");
+	if (!dir)
+		return;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, CACHE_NAME + 1, strlen(CACHE_NAME) - 1) != 0
+		    || entry->d_name[strlen(CACHE_NAME) - 1] != '-')
+			continue;
+
+		char name[NAME_MAX + 2];
+		snprintf(name, sizeof(name), "/%s", entry->d_name);
+		if (shm_unlink(name) == 0)
+			blog(LOG_INFO, "removed stale shared memory segment %s", name);
+	}
+	closedir(dir);
+}
+
+/* pass file descriptors to the browser over its end of the socketpair,
+ * together with size bytes of payload */
+static bool send_fds(int sock, const void* payload, size_t size, const int* fds, size_t count)
+{
+	struct iovec iov = {.iov_base = (void*) payload, .iov_len = size};
+	char control[CMSG_SPACE(sizeof(int) * SHARED_IPC_MAX_FDS)];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (count > 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	}
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) size;
 }
 
 /* remove an optional set of matching quotes (single or double),
@@ -58,20 +111,143 @@ static char* remove_matching_quotes(char* val)
 	return val + 1;
 }
 
-/* mostly building strings for arguments and env variables for
- * browser process */
-static void spawn_renderer(browser_manager_t* manager)
+/* make the blob arena at least size bytes large */
+static bool grow_blobs(browser_manager_t* manager, size_t size)
 {
-	if (manager->spawned)
-		return;
+	size_t new_size = manager->blobs_size ? manager->blobs_size : SHARED_BLOB_ARENA_MIN;
+	while (new_size < size)
+		new_size *= 2;
+
+	if (ftruncate(manager->blob_fd, new_size) == -1) {
+		blog(LOG_ERROR, "%s: growing the blob arena failed", manager->name);
+		return false;
+	}
+	uint8_t* blobs =
+	    mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, manager->blob_fd, 0);
+	if (blobs == MAP_FAILED) {
+		blog(LOG_ERROR, "%s: mapping the blob arena failed", manager->name);
+		return false;
+	}
+	if (manager->blobs)
+		munmap(manager->blobs, manager->blobs_size);
+	manager->blobs = blobs;
+	manager->blobs_size = new_size;
+	return true;
+}
+
+/* copy text into the blob arena and fill in its offset and generation,
+ * generation 0 for an empty text. Returns false if the arena could not take
+ * it, the message referring to it must not be sent then. Called with the
+ * send lock held, so that blobs are queued in the order they are written. */
+static bool put_blob(browser_manager_t* manager, const char* text, uint64_t* offset,
+                     uint32_t* generation)
+{
+	size_t size = text ? strlen(text) : 0;
+	*offset = 0;
+	*generation = 0;
+	if (size == 0)
+		return true;
+
+	if (__atomic_load_n(&manager->data->blob_done, __ATOMIC_ACQUIRE)
+	    == manager->blob_generation)
+		manager->blob_head = 0;
+	size_t end = manager->blob_head + sizeof(shared_blob_t) + size;
+	if (end > manager->blobs_size && !grow_blobs(manager, end)) {
+		blog(LOG_ERROR, "%s: no room for %zu bytes of page text", manager->name, size);
+		return false;
+	}
 
+	shared_blob_t* blob = (shared_blob_t*) (manager->blobs + manager->blob_head);
+	memcpy(blob + 1, text, size);
+	blob->size = size;
+	if (++manager->blob_generation == 0)
+		manager->blob_generation = 1;
+	blob->generation = manager->blob_generation;
+
+	*offset = manager->blob_head;
+	*generation = blob->generation;
+	manager->blob_head = SHARED_ROUND(end, SHARED_BLOB_ALIGN);
+	return true;
+}
+
+/* contents of a css or js file, NULL if there is none */
+static char* read_text_file(const char* path)
+{
+	return path && *path ? os_quick_read_utf8_file(path) : NULL;
+}
+
+/* hand the current page state to the next browser, css and js go along as
+ * file contents. Called with the send lock held and no browser running.
+ * Returns false if the page state did not fit. */
+static bool write_startup(browser_manager_t* manager)
+{
+	browser_config_t* config = &manager->config;
+	shared_startup_t* startup = &manager->data->startup;
+
+	pthread_mutex_lock(&manager->config_lock);
+
+	/* nobody is left to read what the old browser did not */
+	__atomic_store_n(&manager->data->blob_done, manager->blob_generation, __ATOMIC_RELEASE);
+
+	startup->changed = BROWSER_CONFIG_ALL;
+	startup->scrollbars = config->scrollbars;
+	startup->zoom = config->zoom;
+	startup->scroll_vertical = config->scroll_vertical;
+	startup->scroll_horizontal = config->scroll_horizontal;
+	startup->suspended = manager->suspended;
+	startup->begin_frame = manager->begin_frame;
+
+	char* css = read_text_file(config->css_file);
+	char* js = read_text_file(config->js_file);
+	bool written =
+	    put_blob(manager, manager->cache_name, &startup->cache_offset, &startup->cache_blob)
+	    && put_blob(manager, config->url, &startup->url_offset, &startup->url_blob)
+	    && put_blob(manager, css, &startup->css_offset, &startup->css_blob)
+	    && put_blob(manager, js, &startup->js_offset, &startup->js_blob);
+	pthread_mutex_unlock(&manager->config_lock);
+	bfree(css);
+	bfree(js);
+	return written;
+}
+
+/* set name=value in env, which holds count entries and has room for one
+ * more, replacing an entry of the same name */
+static void put_env(char** env, size_t* count, const char* name, const char* value)
+{
+	size_t name_len = strlen(name);
+	size_t entry_size = name_len + strlen(value) + 2;
+	char* entry = bzalloc(entry_size);
+	snprintf(entry, entry_size, "%s=%s", name, value);
+
+	for (size_t i = 0; i < *count; i++) {
+		if (strncmp(env[i], entry, name_len + 1) == 0) {
+			bfree(env[i]);
+			env[i] = entry;
+			return;
+		}
+	}
+	env[(*count)++] = entry;
+}
+
+/* the browser's end of the socketpair is passed on as this fd, which unlike
+ * sock itself survives the exec */
+#define SPAWN_IPC_FD 3
+
+/* mostly building strings for arguments and env variables for
+ * browser process, which gets sock as its end of the socketpair. settings
+ * are the source's, NULL for none. Everything is put together up front,
+ * posix_spawn only execs in the child, so nothing runs in a copy of the
+ * OBS process. Returns the pid of the browser. */
+static int launch_browser(obs_data_t* settings, const char* cache_name, int sock)
+{
+	uint64_t start_ts = os_gettime_ns();
 	char* bin_dir = bstrdup(obs_get_module_binary_path(obs_current_module()));
 	char* s = strrchr(bin_dir, '/');
 	if (s)
 		*(s + 1) = '\0';
 
-	const char* sflash_path = obs_data_get_string(manager->settings, "flash_path");
-	const char* sflash_version = obs_data_get_string(manager->settings, "flash_version");
+	const char* sflash_path = obs_data_get_string(settings, "flash_path");
+	const char* sflash_version = obs_data_get_string(settings, "flash_version");
 
 	size_t flash_path_size = strlen("--ppapi-flash-path=") + strlen(sflash_path) + 1;
 	char* flash_path = bzalloc(flash_path_size);
@@ -87,50 +263,88 @@ static void spawn_renderer(browser_manager_t* manager)
 
 	char* data_path = (char*) obs_get_module_data_path(obs_current_module());
 
-	obs_data_array_t* env_vars = obs_data_get_array(manager->settings, "cef_environment");
-	size_t env_num = obs_data_array_count(env_vars);
+	int ipc_target = sock == SPAWN_IPC_FD ? SPAWN_IPC_FD + 1 : SPAWN_IPC_FD;
+	char ipc_fd[16];
+	snprintf(ipc_fd, sizeof(ipc_fd), "%d", ipc_target);
 
-	obs_data_array_t* command_lines = obs_data_get_array(manager->settings, "cef_command_line");
-	size_t arg_num = 6 + obs_data_array_count(command_lines);
+	obs_data_array_t* command_lines = obs_data_get_array(settings, "cef_command_line");
+	size_t arg_num = 7 + obs_data_array_count(command_lines);
 
 	char** argv = bzalloc(sizeof(char*) * arg_num);
 	argv[0] = renderer;
 	argv[1] = data_path;
-	argv[2] = manager->shmname;
-	argv[3] = flash_path;
-	argv[4] = flash_version;
+	argv[2] = (char*) cache_name;
+	argv[3] = ipc_fd;
+	argv[4] = flash_path;
+	argv[5] = flash_version;
 
-	for (int i = 0; i < arg_num - 6; ++i) {
+	for (int i = 0; i < arg_num - 7; ++i) {
 		obs_data_t* item = obs_data_array_item(command_lines, i);
 		const char* value = obs_data_get_string(item, "value");
-		argv[5 + i] = bstrdup(value);
+		argv[6 + i] = bstrdup(value);
 		obs_data_release(item);
 	}
 
 	argv[arg_num - 1] = NULL;
 
-	manager->pid = fork();
-	if (manager->pid == 0) {
-		setenv("LD_LIBRARY_PATH", bin_dir, 1);
-		for (int i = 0; i < env_num; ++i) {
-			obs_data_t* item = obs_data_array_item(env_vars, i);
-			const char* value = obs_data_get_string(item, "value");
-			char* entry = bstrdup(value);
-			/* split entry "env_name=env_val" */
-			char* env_name = strtok(entry, "=");
-			char* env_val = strtok(NULL, "");
-			if (env_name && env_val) {
-				env_val = remove_matching_quotes(env_val);
-				setenv(env_name, env_val, 1);
-			}
-			bfree(entry);
-			obs_data_release(item);
-		}
-		execv(renderer, argv);
+	obs_data_array_t* env_vars = obs_data_get_array(settings, "cef_environment");
+	size_t env_num = obs_data_array_count(env_vars);
+	size_t env_count = 0;
+	while (environ[env_count])
+		env_count++;
+
+	char** envp = bzalloc(sizeof(char*) * (env_count + env_num + 2));
+	size_t envc = 0;
+	for (size_t i = 0; i < env_count; i++)
+		envp[envc++] = bstrdup(environ[i]);
+	put_env(envp, &envc, "LD_LIBRARY_PATH", bin_dir);
+	for (int i = 0; i < env_num; ++i) {
+		obs_data_t* item = obs_data_array_item(env_vars, i);
+		const char* value = obs_data_get_string(item, "value");
+		char* entry = bstrdup(value);
+		/* split entry "env_name=env_val" */
+		char* env_name = strtok(entry, "=");
+		char* env_val = strtok(NULL, "");
+		if (env_name && env_val)
+			put_env(envp, &envc, env_name, remove_matching_quotes(env_val));
+		bfree(entry);
+		obs_data_release(item);
 	}
 
-	for (int i = 0; i < arg_num - 6; ++i) {
-		bfree(argv[5 + i]);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, sock, ipc_target);
+
+	/* the browser starts out with no signal blocked or ignored, whatever OBS
+	 * set up for its own threads */
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t signals;
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attr, &signals);
+	sigfillset(&signals);
+	posix_spawnattr_setsigdefault(&attr, &signals);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	pid_t pid;
+	int err = posix_spawn(&pid, renderer, &actions, &attr, argv, envp);
+	if (err != 0) {
+		blog(LOG_ERROR, "starting the browser failed: %s", strerror(err));
+		pid = 0;
+	} else {
+		blog(LOG_DEBUG, "browser started in %llu us",
+		     (unsigned long long) (os_gettime_ns() - start_ts) / 1000ULL);
+	}
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	for (size_t i = 0; i < envc; i++)
+		bfree(envp[i]);
+	bfree(envp);
+	obs_data_array_release(env_vars);
+
+	for (int i = 0; i < arg_num - 7; ++i) {
+		bfree(argv[6 + i]);
 	}
 	obs_data_array_release(command_lines);
 	bfree(argv);
@@ -140,18 +354,848 @@ static void spawn_renderer(browser_manager_t* manager)
 	bfree(flash_version);
 	bfree(renderer);
 
+	return pid;
+}
+
+/* the browser's parent death signal fires when the thread that started it
+ * ends, not the process. So browsers are all started from the launcher
+ * thread, which lives until the module is unloaded, rather than from
+ * whatever thread asks, like a source's status thread. */
+struct launch_request {
+	obs_data_t* settings;
+	const char* cache_name;
+	int sock;
+	int pid;
+	bool done;
+	struct launch_request* next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	struct launch_request* queue;
+} launcher = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void* launcher_thread(void* vptr)
+{
+	pthread_mutex_lock(&launcher.lock);
+	while (!launcher.stop || launcher.queue) {
+		struct launch_request* request = launcher.queue;
+		if (!request) {
+			pthread_cond_wait(&launcher.cond, &launcher.lock);
+			continue;
+		}
+		launcher.queue = request->next;
+
+		pthread_mutex_unlock(&launcher.lock);
+		int pid = launch_browser(request->settings, request->cache_name, request->sock);
+		pthread_mutex_lock(&launcher.lock);
+		request->pid = pid;
+		request->done = true;
+		pthread_cond_broadcast(&launcher.done);
+	}
+	pthread_mutex_unlock(&launcher.lock);
+	return NULL;
+}
+
+/* starts the browser on the launcher thread and waits for it, see
+ * launch_browser */
+static int exec_browser(obs_data_t* settings, const char* cache_name, int sock)
+{
+	struct launch_request request = {settings, cache_name, sock, 0, false, NULL};
+
+	pthread_mutex_lock(&launcher.lock);
+	if (!launcher.running) {
+		if (launcher.stop
+		    || pthread_create(&launcher.thread, NULL, launcher_thread, NULL) != 0) {
+			blog(LOG_ERROR, "starting the launcher thread failed");
+			pthread_mutex_unlock(&launcher.lock);
+			return 0;
+		}
+		launcher.running = true;
+	}
+	struct launch_request** tail = &launcher.queue;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = &request;
+	pthread_cond_signal(&launcher.cond);
+	while (!request.done)
+		pthread_cond_wait(&launcher.done, &launcher.lock);
+	pthread_mutex_unlock(&launcher.lock);
+	return request.pid;
+}
+
+/* no browser is started after this, the ones still running get their
+ * parent death signal */
+void browser_manager_stop_launcher(void)
+{
+	pthread_mutex_lock(&launcher.lock);
+	launcher.stop = true;
+	bool running = launcher.running;
+	pthread_cond_signal(&launcher.cond);
+	pthread_mutex_unlock(&launcher.lock);
+
+	if (running)
+		pthread_join(launcher.thread, NULL);
+	launcher.running = false;
+}
+
+/* browsers on their way out. They get SIGTERM when handed over and SIGKILL
+ * once they are still around REAPER_KILL_NS later, the reaper thread waits
+ * for them so that nobody else has to. */
+#define REAPER_KILL_NS 3000000000ULL
+#define REAPER_POLL_NS 20000000ULL
+
+struct dying_browser {
+	int pid;
+	uint64_t deadline;
+	bool killed;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	size_t count;
+	size_t capacity;
+	struct dying_browser* dying;
+} reaper = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void* reaper_thread(void* vptr)
+{
+	pthread_mutex_lock(&reaper.lock);
+	while (true) {
+		uint64_t now = os_gettime_ns();
+		for (size_t i = 0; i < reaper.count;) {
+			struct dying_browser* browser = &reaper.dying[i];
+			if (waitpid(browser->pid, NULL, WNOHANG) != 0) {
+				*browser = reaper.dying[--reaper.count];
+				continue;
+			}
+			if (!browser->killed && (reaper.stop || now >= browser->deadline)) {
+				if (!reaper.stop)
+					blog(LOG_WARNING,
+					     "browser %d did not exit in time, killing it",
+					     browser->pid);
+				kill(browser->pid, SIGKILL);
+				browser->killed = true;
+			}
+			i++;
+		}
+
+		if (reaper.count == 0) {
+			if (reaper.stop)
+				break;
+			pthread_cond_wait(&reaper.cond, &reaper.lock);
+		} else {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			uint64_t wake = ts.tv_nsec + REAPER_POLL_NS;
+			ts.tv_sec += wake / 1000000000ULL;
+			ts.tv_nsec = wake % 1000000000ULL;
+			pthread_cond_timedwait(&reaper.cond, &reaper.lock, &ts);
+		}
+	}
+	pthread_mutex_unlock(&reaper.lock);
+	return NULL;
+}
+
+/* stop the browser with the given pid without waiting for it */
+static void reap_browser(int pid)
+{
+	if (pid <= 0)
+		return;
+
+	kill(pid, SIGTERM);
+	pthread_mutex_lock(&reaper.lock);
+	if (!reaper.running) {
+		if (pthread_create(&reaper.thread, NULL, reaper_thread, NULL) != 0) {
+			blog(LOG_ERROR, "starting the reaper thread failed");
+			pthread_mutex_unlock(&reaper.lock);
+			return;
+		}
+		reaper.running = true;
+	}
+	if (reaper.count == reaper.capacity) {
+		reaper.capacity = reaper.capacity ? reaper.capacity * 2 : 8;
+		reaper.dying =
+		    brealloc(reaper.dying, sizeof(struct dying_browser) * reaper.capacity);
+	}
+	reaper.dying[reaper.count++] =
+	    (struct dying_browser){pid, os_gettime_ns() + REAPER_KILL_NS, false};
+	pthread_cond_signal(&reaper.cond);
+	pthread_mutex_unlock(&reaper.lock);
+}
+
+/* whether the reaper is done with pid */
+static bool browser_reaped(int pid)
+{
+	bool dying = false;
+	pthread_mutex_lock(&reaper.lock);
+	for (size_t i = 0; i < reaper.count; i++)
+		dying |= reaper.dying[i].pid == pid;
+	pthread_mutex_unlock(&reaper.lock);
+	return !dying;
+}
+
+/* kills whatever browsers are still going and waits until they are gone */
+void browser_manager_stop_reaper(void)
+{
+	pthread_mutex_lock(&reaper.lock);
+	if (!reaper.running) {
+		pthread_mutex_unlock(&reaper.lock);
+		return;
+	}
+	reaper.stop = true;
+	pthread_cond_signal(&reaper.cond);
+	pthread_mutex_unlock(&reaper.lock);
+
+	pthread_join(reaper.thread, NULL);
+	bfree(reaper.dying);
+	reaper.dying = NULL;
+	reaper.count = 0;
+	reaper.capacity = 0;
+	reaper.running = false;
+	reaper.stop = false;
+}
+
+/* the browser process all sources with the shared_host setting attach to,
+ * started by the first of them, without its settings, and stopped once the
+ * last one detached.
+ * lost_pid and lost_status are those of the last host that exited on its
+ * own, for the watchdogs of the sources it took along. */
+static struct {
+	pthread_mutex_t lock;
+	int pid;
+	int sock;
+	uint32_t next_id;
+	uint32_t refs;
+	int lost_pid;
+	int lost_status;
+} host = {PTHREAD_MUTEX_INITIALIZER, 0, -1, 0, 0, 0, 0};
+
+/* must be called with the host lock held */
+static void reap_host(void)
+{
+	int status;
+	if (host.pid <= 0 || waitpid(host.pid, &status, WNOHANG) != host.pid)
+		return;
+
+	host.lost_pid = host.pid;
+	host.lost_status = status;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == BROWSER_EXIT_PROTOCOL)
+		blog(LOG_ERROR, "shared browser host does not speak protocol version %d, the "
+		                "plugin installation is inconsistent",
+		     BROWSER_PROTOCOL_VERSION);
+	else
+		blog(LOG_ERROR, "shared browser host exited");
+	close(host.sock);
+	host.pid = 0;
+	host.sock = -1;
+	host.refs = 0;
+}
+
+static bool attach_host(browser_manager_t* manager)
+{
+	pthread_mutex_lock(&host.lock);
+	reap_host();
+	if (host.pid <= 0) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+			blog(LOG_ERROR, "socketpair error");
+			pthread_mutex_unlock(&host.lock);
+			return false;
+		}
+		host.pid = exec_browser(NULL, "", sv[1]);
+		close(sv[1]);
+		if (host.pid <= 0) {
+			close(sv[0]);
+			host.pid = 0;
+			pthread_mutex_unlock(&host.lock);
+			return false;
+		}
+		host.sock = sv[0];
+		blog(LOG_INFO, "started shared browser host");
+	}
+
+	shared_attach_t attach = {BROWSER_PROTOCOL_VERSION, SHARED_ATTACH, ++host.next_id,
+	                          SHARED_ATTACH_HOST};
+	int fds[] = {manager->fd, manager->doorbell, manager->blob_fd, manager->status_doorbell};
+	bool attached = send_fds(host.sock, &attach, sizeof(attach), fds, 4);
+	if (attached) {
+		manager->host_id = attach.id;
+		manager->host_pid = host.pid;
+		host.refs++;
+	} else {
+		blog(LOG_ERROR, "failed to pass shared memory to the browser");
+	}
+	pthread_mutex_unlock(&host.lock);
+	return attached;
+}
+
+/* takes the source's browser out of the shared host, which is stopped along
+ * with its last one */
+static void detach_host(browser_manager_t* manager)
+{
+	pthread_mutex_lock(&host.lock);
+	reap_host();
+	if (manager->host_pid > 0 && manager->host_pid == host.pid) {
+		if (host.refs > 1) {
+			shared_attach_t detach = {BROWSER_PROTOCOL_VERSION, SHARED_DETACH,
+			                          manager->host_id, SHARED_ATTACH_HOST};
+			if (!send_fds(host.sock, &detach, sizeof(detach), NULL, 0))
+				blog(LOG_WARNING, "%s: detaching from the shared browser host "
+				                  "failed",
+				     manager->name);
+			host.refs--;
+		} else {
+			reap_browser(host.pid);
+			close(host.sock);
+			host.pid = 0;
+			host.sock = -1;
+			host.refs = 0;
+		}
+	}
+	if (manager->shared_host)
+		manager->spawned = false;
+	manager->host_pid = 0;
+	pthread_mutex_unlock(&host.lock);
+}
+
+/* browsers started ahead of time that sit idle with CEF already set up
+ * until a source claims one, see browser_manager_init_pool. A failed start
+ * is retried after POOL_BACKOFF_MIN_NS, doubling up to POOL_BACKOFF_MAX_NS
+ * while it keeps failing. */
+#define POOL_MAX 8
+#define POOL_BACKOFF_MIN_NS 500000000ULL
+#define POOL_BACKOFF_MAX_NS 60000000000ULL
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	int size;
+	int count;
+	int pids[POOL_MAX];
+	int socks[POOL_MAX];
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static int prewarm_browser(int* sock)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		blog(LOG_ERROR, "socketpair error");
+		return 0;
+	}
+	int pid = exec_browser(NULL, "", sv[1]);
+	close(sv[1]);
+
+	shared_attach_t idle = {BROWSER_PROTOCOL_VERSION, SHARED_IDLE, 0, 0};
+	if (pid <= 0 || !send_fds(sv[0], &idle, sizeof(idle), NULL, 0)) {
+		reap_browser(pid);
+		close(sv[0]);
+		return 0;
+	}
+	*sock = sv[0];
+	return pid;
+}
+
+/* keeps the pool filled up */
+static void* pool_thread(void* vptr)
+{
+	uint64_t backoff = 0;
+	uint64_t retry_ts = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.stop) {
+		uint64_t now = os_gettime_ns();
+		if (now < retry_ts) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			uint64_t wake = ts.tv_nsec + (retry_ts - now);
+			ts.tv_sec += wake / 1000000000ULL;
+			ts.tv_nsec = wake % 1000000000ULL;
+			pthread_cond_timedwait(&pool.cond, &pool.lock, &ts);
+			continue;
+		}
+		if (pool.count >= pool.size) {
+			pthread_cond_wait(&pool.cond, &pool.lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool.lock);
+		int sock;
+		int pid = prewarm_browser(&sock);
+		pthread_mutex_lock(&pool.lock);
+		if (pid <= 0) {
+			backoff = backoff ? backoff * 2 : POOL_BACKOFF_MIN_NS;
+			if (backoff > POOL_BACKOFF_MAX_NS)
+				backoff = POOL_BACKOFF_MAX_NS;
+			blog(LOG_WARNING, "starting a prewarmed browser failed, retrying in %d ms",
+			     (int) (backoff / 1000000));
+			retry_ts = os_gettime_ns() + backoff;
+			continue;
+		}
+		backoff = 0;
+		pool.pids[pool.count] = pid;
+		pool.socks[pool.count] = sock;
+		pool.count++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+void browser_manager_init_pool(int size)
+{
+	if (size <= 0)
+		return;
+
+	pool.size = size < POOL_MAX ? size : POOL_MAX;
+	if (pthread_create(&pool.thread, NULL, pool_thread, NULL) != 0) {
+		blog(LOG_ERROR, "starting the browser pool failed");
+		return;
+	}
+	pool.running = true;
+	blog(LOG_INFO, "keeping %d prewarmed browsers", pool.size);
+}
+
+void browser_manager_free_pool(void)
+{
+	if (!pool.running)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	pthread_join(pool.thread, NULL);
+
+	for (int i = 0; i < pool.count; i++) {
+		reap_browser(pool.pids[i]);
+		close(pool.socks[i]);
+	}
+	pool.count = 0;
+	pool.running = false;
+}
+
+/* pooled browsers and the shared host run without flash, extra environment
+ * or command line, a source asking for any of them gets a browser of its
+ * own */
+static bool pool_fits(obs_data_t* settings)
+{
+	obs_data_array_t* env_vars = obs_data_get_array(settings, "cef_environment");
+	obs_data_array_t* command_lines = obs_data_get_array(settings, "cef_command_line");
+	bool fits = !*obs_data_get_string(settings, "flash_path")
+	            && !*obs_data_get_string(settings, "flash_version")
+	            && obs_data_array_count(env_vars) == 0
+	            && obs_data_array_count(command_lines) == 0;
+	obs_data_array_release(env_vars);
+	obs_data_array_release(command_lines);
+	return fits;
+}
+
+/* take the oldest idle browser still alive out of the pool and have it
+ * refilled, returns its pid and socket or 0 if there is none */
+static int claim_pooled(browser_manager_t* manager, int* sock)
+{
+	if (!pool.running || !pool_fits(manager->settings))
+		return 0;
+
+	int pid = 0;
+	pthread_mutex_lock(&pool.lock);
+	while (pool.count > 0 && pid == 0) {
+		pid = pool.pids[0];
+		*sock = pool.socks[0];
+		pool.count--;
+		memmove(pool.pids, pool.pids + 1, sizeof(int) * pool.count);
+		memmove(pool.socks, pool.socks + 1, sizeof(int) * pool.count);
+		if (waitpid(pid, NULL, WNOHANG) != 0) {
+			close(*sock);
+			pid = 0;
+		}
+	}
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	return pid;
+}
+
+static void launch_renderer(browser_manager_t* manager);
+
+static void spawn_renderer(browser_manager_t* manager)
+{
+	if (manager->spawned)
+		return;
+
+	/* whatever the old browser left queued is covered by the startup state */
+	pthread_mutex_lock(&manager->send_lock);
+	__atomic_add_fetch(&manager->data->owner, 1, __ATOMIC_RELEASE);
+	shared_ring_clear(&manager->data->commands);
+	manager->coalesce_valid = false;
+	manager->held_types = 0;
+	manager->resend_config = false;
+	bool written = write_startup(manager);
+	pthread_mutex_unlock(&manager->send_lock);
+	if (!written) {
+		blog(LOG_ERROR, "%s: not starting the browser without its page state",
+		     manager->name);
+		return;
+	}
+
+	manager->data->browser_protocol = 0;
+	manager->confirmed = false;
+	manager->spawn_ts = shared_time_ns();
+	manager->started_ts = manager->spawn_ts;
+
+	/* two browsers on the same cache path trip over CEF's lock on it. Rather
+	 * than wait here, the status thread launches this one once the old one is
+	 * gone, see launch_pending_browser. */
+	if (manager->dying_pid > 0 && !browser_reaped(manager->dying_pid)) {
+		__atomic_store_n(&manager->launch_pending, true, __ATOMIC_RELAXED);
+		manager->spawned = true;
+		eventfd_write(manager->status_doorbell, 1);
+		return;
+	}
+	launch_renderer(manager);
+}
+
+/* the second half of spawn_renderer, which starts the browser process or
+ * gets one from the pool or the shared host */
+static void launch_renderer(browser_manager_t* manager)
+{
+	manager->dying_pid = 0;
+	__atomic_store_n(&manager->launch_pending, false, __ATOMIC_RELAXED);
+
+	manager->shared_host = obs_data_get_bool(manager->settings, "shared_host");
+	if (manager->shared_host && !pool_fits(manager->settings)) {
+		blog(LOG_INFO, "%s: flash, environment or command line set, not sharing the "
+		               "browser process",
+		     manager->name);
+		manager->shared_host = false;
+	}
+	if (manager->shared_host) {
+		manager->spawned = attach_host(manager);
+		return;
+	}
+
+	int sock;
+	manager->pid = claim_pooled(manager, &sock);
+	manager->prewarmed = manager->pid > 0;
+	if (!manager->prewarmed) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+			blog(LOG_ERROR, "socketpair error");
+			return;
+		}
+		manager->pid = exec_browser(manager->settings, manager->cache_name, sv[1]);
+		close(sv[1]);
+		sock = sv[0];
+	}
+
+	shared_attach_t attach = {BROWSER_PROTOCOL_VERSION, SHARED_ATTACH, 0, 0};
+	int fds[] = {manager->fd, manager->doorbell, manager->blob_fd, manager->status_doorbell};
+	if (manager->pid > 0 && !send_fds(sock, &attach, sizeof(attach), fds, 4))
+		blog(LOG_ERROR, "failed to pass shared memory to the browser");
+	close(sock);
+
 	manager->spawned = true;
 }
 
+/* a source in the shared host is taken out by detach_host instead. Does not
+ * wait for the browser, the owner bump of the next start keeps it off the
+ * segment while it winds down and the next launch waits for it to be gone
+ * before starting another one on its cache path. */
 static void kill_renderer(browser_manager_t* manager)
 {
+	if (manager->launch_pending) {
+		__atomic_store_n(&manager->launch_pending, false, __ATOMIC_RELAXED);
+		manager->spawned = false;
+	}
 	if (manager->pid > 0) {
-		kill(manager->pid, SIGTERM);
-		waitpid(manager->pid, NULL, 0);
+		reap_browser(manager->pid);
+		manager->dying_pid = manager->pid;
+		manager->pid = 0;
 		manager->spawned = false;
 	}
 }
 
+/* whether the browser agreed to our protocol version. A browser binary of
+ * another version exits instead, which the watchdog reports. */
+static bool browser_confirmed(browser_manager_t* manager)
+{
+	if (manager->confirmed)
+		return true;
+	if (__atomic_load_n(&manager->data->browser_protocol, __ATOMIC_ACQUIRE)
+	    == BROWSER_PROTOCOL_VERSION) {
+		manager->confirmed = true;
+		return true;
+	}
+	return false;
+}
+
+/* lay the frame slots out for the given size, growing the segment if they
+ * do not fit and giving back the pages a bigger previous layout used.
+ * Must be called with the shared mutex held. */
+static bool layout_frames(browser_manager_t* manager, uint32_t width, uint32_t height)
+{
+	struct shared_data* data = manager->data;
+	size_t frame_size = shared_frame_size(width, height, data->huge_pages);
+	size_t needed = SHARED_FRAME_SLOTS * frame_size;
+
+	if (needed > data->frame_area_size) {
+		if (ftruncate(manager->fd, SHARED_FRAME_OFFSET + needed) == -1) {
+			blog(LOG_ERROR, "ftruncate error");
+			return false;
+		}
+		void* frames;
+		if (manager->frames)
+			frames = mremap(manager->frames, manager->frames_size, needed,
+			                MREMAP_MAYMOVE);
+		else
+			frames = mmap(NULL, needed, PROT_READ | PROT_WRITE, MAP_SHARED,
+			              manager->fd, SHARED_FRAME_OFFSET);
+		if (frames == MAP_FAILED) {
+			blog(LOG_ERROR, "frame mmap error");
+			return false;
+		}
+		if (data->huge_pages)
+			madvise(frames, needed, MADV_HUGEPAGE);
+		manager->frames = frames;
+		manager->frames_size = needed;
+		data->frame_area_size = needed;
+	} else if (needed < data->frame_area_size) {
+		madvise(manager->frames + needed, data->frame_area_size - needed, MADV_REMOVE);
+	}
+
+	data->width = width;
+	data->height = height;
+	data->frame_pitch = shared_frame_pitch(width);
+	data->frame_size = frame_size;
+	__atomic_add_fetch(&data->layout_generation, 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* the watchdog lives on the status thread. A browser that exited or whose
+ * heartbeat is older than WATCHDOG_HANG_NS is restarted with the current
+ * page state after a backoff that doubles with every crash, up to
+ * WATCHDOG_BACKOFF_MAX_NS, unless it ran for WATCHDOG_STABLE_NS before. */
+#define WATCHDOG_INTERVAL_MS 1000
+#define WATCHDOG_HANG_NS 15000000000ULL
+#define WATCHDOG_BACKOFF_MIN_NS 500000000ULL
+#define WATCHDOG_BACKOFF_MAX_NS 60000000000ULL
+#define WATCHDOG_STABLE_NS 60000000000ULL
+
+static int browser_pid(browser_manager_t* manager)
+{
+	return __atomic_load_n(manager->shared_host ? &manager->host_pid : &manager->pid,
+	                       __ATOMIC_RELAXED);
+}
+
+/* whether the browser exited and if so whether it refused our protocol
+ * version */
+static bool browser_exited(browser_manager_t* manager, int pid, bool* refused)
+{
+	if (manager->shared_host) {
+		pthread_mutex_lock(&host.lock);
+		reap_host();
+		bool exited = host.pid != pid;
+		*refused = exited && host.lost_pid == pid && WIFEXITED(host.lost_status)
+		           && WEXITSTATUS(host.lost_status) == BROWSER_EXIT_PROTOCOL;
+		pthread_mutex_unlock(&host.lock);
+		return exited;
+	}
+
+	/* left for kill_renderer to reap, until then the pid stays ours */
+	siginfo_t info = {0};
+	if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid != pid)
+		return false;
+	*refused = info.si_code == CLD_EXITED && info.si_status == BROWSER_EXIT_PROTOCOL;
+	return true;
+}
+
+/* a browser of another version would only exit again, the source stays
+ * without one until it is restarted by hand */
+static void drop_browser(browser_manager_t* manager, int pid)
+{
+	if (!manager->shared_host)
+		blog(LOG_ERROR,
+		     "%s: browser binary does not speak protocol version %d, the plugin "
+		     "installation is inconsistent",
+		     manager->name, BROWSER_PROTOCOL_VERSION);
+
+	shared_lock(&manager->data->mutex);
+	if (manager->spawned && browser_pid(manager) == pid) {
+		detach_host(manager);
+		kill_renderer(manager);
+		manager->spawned = false;
+	}
+	pthread_mutex_unlock(&manager->data->mutex);
+}
+
+static void lose_browser(browser_manager_t* manager, int pid, const char* reason, uint64_t now)
+{
+	if (now - manager->started_ts > WATCHDOG_STABLE_NS)
+		manager->crash_streak = 0;
+	uint32_t shift = manager->crash_streak < 10 ? manager->crash_streak : 10;
+	uint64_t backoff = WATCHDOG_BACKOFF_MIN_NS << shift;
+	if (backoff > WATCHDOG_BACKOFF_MAX_NS)
+		backoff = WATCHDOG_BACKOFF_MAX_NS;
+	manager->crash_streak++;
+	uint32_t crashes = __atomic_add_fetch(&manager->crashes, 1, __ATOMIC_RELAXED);
+
+	blog(LOG_WARNING, "%s: browser %s after %llu s, restarting in %llu ms (crash %u)",
+	     manager->name, reason,
+	     (unsigned long long) (now - manager->started_ts) / 1000000000ULL,
+	     (unsigned long long) backoff / 1000000ULL, crashes);
+	manager->lost_pid = pid;
+	manager->lost_ts = now;
+	manager->recover_at = now + backoff;
+}
+
+/* start over with the page state unless the browser was stopped or
+ * restarted in the meantime, the texture keeps the last frame until the new
+ * one paints */
+static void respawn_browser(browser_manager_t* manager)
+{
+	shared_lock(&manager->data->mutex);
+	if (manager->spawned && browser_pid(manager) == manager->lost_pid) {
+		detach_host(manager);
+		kill_renderer(manager);
+		spawn_renderer(manager);
+		manager->recover_ts = manager->lost_ts;
+	}
+	manager->lost_pid = 0;
+	pthread_mutex_unlock(&manager->data->mutex);
+}
+
+/* launches the browser spawn_renderer held back once the one before it is
+ * gone, returns how long to sleep until the next check */
+static int launch_pending_browser(browser_manager_t* manager)
+{
+	shared_lock(&manager->data->mutex);
+	bool waiting = manager->launch_pending && !browser_reaped(manager->dying_pid);
+	if (manager->launch_pending && !waiting)
+		launch_renderer(manager);
+	pthread_mutex_unlock(&manager->data->mutex);
+	return waiting ? (int) (REAPER_POLL_NS / 1000000ULL) : WATCHDOG_INTERVAL_MS;
+}
+
+/* checks on the browser, returns how long to sleep until the next check */
+static int watch_browser(browser_manager_t* manager)
+{
+	if (__atomic_load_n(&manager->launch_pending, __ATOMIC_RELAXED))
+		return launch_pending_browser(manager);
+
+	uint64_t now = shared_time_ns();
+	if (manager->lost_pid) {
+		if (now < manager->recover_at) {
+			uint64_t wait_ms = (manager->recover_at - now) / 1000000ULL + 1;
+			if (wait_ms < WATCHDOG_INTERVAL_MS)
+				return (int) wait_ms;
+			return WATCHDOG_INTERVAL_MS;
+		}
+		respawn_browser(manager);
+		return WATCHDOG_INTERVAL_MS;
+	}
+
+	int pid = browser_pid(manager);
+	if (!__atomic_load_n(&manager->spawned, __ATOMIC_RELAXED) || pid <= 0)
+		return WATCHDOG_INTERVAL_MS;
+
+	/* the heartbeat only starts once the browser confirmed */
+	bool confirmed = __atomic_load_n(&manager->data->browser_protocol, __ATOMIC_ACQUIRE)
+	                 == BROWSER_PROTOCOL_VERSION;
+	uint64_t heartbeat = __atomic_load_n(&manager->data->heartbeat, __ATOMIC_ACQUIRE);
+	if (heartbeat < manager->started_ts)
+		heartbeat = manager->started_ts;
+	bool refused = false;
+	if (browser_exited(manager, pid, &refused)) {
+		if (refused)
+			drop_browser(manager, pid);
+		else
+			lose_browser(manager, pid, confirmed ? "exited" : "exited during startup",
+			             now);
+	} else if (confirmed && now - heartbeat > WATCHDOG_HANG_NS) {
+		/* gets the shared host off the other sources as well */
+		kill(pid, SIGKILL);
+		lose_browser(manager, pid, "stopped responding", now);
+	}
+	return WATCHDOG_INTERVAL_MS;
+}
+
+static int open_pidfd(int pid)
+{
+#ifdef SYS_pidfd_open
+	return pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+#else
+	return -1;
+#endif
+}
+
+static void send_held(browser_manager_t* manager);
+
+/* hands the browser's status reports to the status callback as they come in,
+ * sleeping on the status doorbell while there are none. In between it runs
+ * the watchdog, woken by the browser's pidfd as soon as it exits. */
+static void* status_thread(void* vptr)
+{
+	browser_manager_t* manager = vptr;
+	shared_ring_t* ring = &manager->data->status;
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	browser_message_t msg;
+	int watched = 0;
+	int pidfd = -1;
+
+	while (!__atomic_load_n(&manager->status_stop, __ATOMIC_ACQUIRE)) {
+		uint32_t size = shared_ring_pop(ring, buf, sizeof(buf));
+		if (size > 0) {
+			if (size <= sizeof(buf) && browser_decode_message(buf, size, &msg)
+			    && manager->status_callback)
+				manager->status_callback(manager->status_param, &msg);
+			continue;
+		}
+
+		int timeout = watch_browser(manager);
+		/* only a hint, send_held looks again under the send lock */
+		if (__atomic_load_n(&manager->held_types, __ATOMIC_RELAXED)
+		    || __atomic_load_n(&manager->resend_config, __ATOMIC_RELAXED)) {
+			send_held(manager);
+			if (timeout > WATCHDOG_INTERVAL_MS / 10)
+				timeout = WATCHDOG_INTERVAL_MS / 10;
+		}
+		int pid = browser_pid(manager);
+		if (pid != watched) {
+			if (pidfd >= 0)
+				close(pidfd);
+			pidfd = open_pidfd(pid);
+			watched = pid;
+		}
+
+		__atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (shared_ring_empty(ring)) {
+			/* a lost browser's pidfd stays readable */
+			struct pollfd fds[] = {{manager->status_doorbell, POLLIN, 0},
+			                       {manager->lost_pid ? -1 : pidfd, POLLIN, 0}};
+			if (poll(fds, 2, timeout) > 0 && (fds[0].revents & POLLIN)) {
+				eventfd_t count;
+				eventfd_read(manager->status_doorbell, &count);
+			}
+		}
+		__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+	}
+	if (pidfd >= 0)
+		close(pidfd);
+	return NULL;
+}
+
 /* setting up shared data for the browser process */
 browser_manager_t* create_browser_manager(uint32_t width, uint32_t height, int fps,
                                           obs_data_t* settings, const char* uid)
@@ -162,191 +1206,629 @@ browser_manager_t* create_browser_manager(uint32_t width, uint32_t height, int f
 	struct browser_manager* manager = bzalloc(sizeof(struct browser_manager));
 	manager->settings = settings;
 
-	manager->qid = msgget(IPC_PRIVATE, S_IRUSR | S_IWUSR);
-	if (manager->qid == -1) {
-		blog(LOG_ERROR, "msgget error");
+	pthread_mutex_init(&manager->send_lock, NULL);
+	pthread_mutex_init(&manager->config_lock, NULL);
+	manager->config.scrollbars = true;
+	manager->config.zoom = 100;
+	manager->doorbell = eventfd(0, EFD_CLOEXEC);
+	if (manager->doorbell == -1) {
+		blog(LOG_ERROR, "eventfd error");
 		return NULL;
 	}
 
-	manager->shmname = get_shm_name(uid);
-	manager->fd = shm_open(manager->shmname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	manager->name = bstrdup(uid);
+	manager->cache_name = get_cache_name(uid);
+	manager->fd = memfd_create("linuxbrowser", MFD_CLOEXEC | MFD_ALLOW_SEALING);
 	if (manager->fd == -1) {
-		blog(LOG_ERROR, "shm_open error");
+		blog(LOG_ERROR, "memfd_create error");
 		return NULL;
 	}
-	if (ftruncate(manager->fd, sizeof(struct shared_data) + MAX_DATA_SIZE) == -1) {
+	if (ftruncate(manager->fd, SHARED_FRAME_OFFSET) == -1) {
 		blog(LOG_ERROR, "ftruncate error");
 		return NULL;
 	}
-	manager->data =
-	    (struct shared_data*) mmap(NULL, sizeof(struct shared_data) + MAX_DATA_SIZE,
-	                               PROT_READ | PROT_WRITE, MAP_SHARED, manager->fd, 0);
+	/* the segment only ever grows, so the browser never faults on a page
+	 * that went away under it */
+	fcntl(manager->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+	manager->data = (struct shared_data*) mmap(NULL, SHARED_HEADER_SIZE, PROT_READ | PROT_WRITE,
+	                                           MAP_SHARED, manager->fd, 0);
 	if (manager->data == MAP_FAILED) {
 		blog(LOG_ERROR, "mmap error");
 		return NULL;
 	}
-	manager->data->qid = manager->qid;
-	manager->data->width = width;
-	manager->data->height = height;
+	/* grown on first use, never shrinks either */
+	manager->blob_fd = memfd_create("linuxbrowser-blobs", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (manager->blob_fd == -1) {
+		blog(LOG_ERROR, "memfd_create error");
+		return NULL;
+	}
+	fcntl(manager->blob_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
 	manager->data->fps = fps;
+	manager->data->huge_pages = obs_data_get_bool(settings, "huge_pages");
+	shared_frames_init(manager->data);
 
 	pthread_mutexattr_t attrmutex;
 	pthread_mutexattr_init(&attrmutex);
 	pthread_mutexattr_setpshared(&attrmutex, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attrmutex, PTHREAD_MUTEX_ROBUST);
 	pthread_mutex_init(&manager->data->mutex, &attrmutex);
+	pthread_mutexattr_destroy(&attrmutex);
 
-	spawn_renderer(manager);
+	if (!layout_frames(manager, width, height))
+		return NULL;
 
+	manager->status_doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (manager->status_doorbell == -1) {
+		blog(LOG_ERROR, "eventfd error");
+		return NULL;
+	}
+	if (pthread_create(&manager->status_thread, NULL, status_thread, manager) != 0) {
+		blog(LOG_ERROR, "%s: starting the status thread failed", manager->name);
+		return NULL;
+	}
+
+	/* the browser is started by browser_manager_start_browser once the
+	 * page state is known */
 	return manager;
 };
 
 void destroy_browser_manager(browser_manager_t* manager)
 {
+	blog(LOG_INFO,
+	     "%s: %llu ticks without a new frame, %llu frames waited for, %llu painted over",
+	     manager->name, (unsigned long long) manager->frames_skipped,
+	     (unsigned long long) manager->frames_late,
+	     (unsigned long long) manager->frames_dropped);
+	if (manager->messages_dropped)
+		blog(LOG_WARNING, "%s: %llu messages dropped or held back on a full command queue",
+		     manager->name, (unsigned long long) manager->messages_dropped);
+	blog(LOG_INFO, "%s: %llu input events merged before sending, %llu by the browser",
+	     manager->name, (unsigned long long) manager->events_merged,
+	     (unsigned long long) __atomic_load_n(&manager->data->commands.merged,
+	                                          __ATOMIC_RELAXED));
+
+	if (manager->crashes)
+		blog(LOG_WARNING, "%s: browser restarted %u times after a crash", manager->name,
+		     manager->crashes);
+
+	/* the watchdog must not bring the browser back */
+	__atomic_store_n(&manager->status_stop, true, __ATOMIC_RELEASE);
+	eventfd_write(manager->status_doorbell, 1);
+	pthread_join(manager->status_thread, NULL);
+	detach_host(manager);
 	kill_renderer(manager);
+	close(manager->status_doorbell);
 	pthread_mutex_destroy(&manager->data->mutex);
+	if (manager->frames != NULL)
+		munmap(manager->frames, manager->frames_size);
 	if (manager->data != NULL && manager->data != MAP_FAILED)
-		munmap(manager->data, sizeof(struct shared_data) + MAX_DATA_SIZE);
-	if (manager->fd != -1 && manager->shmname != NULL) {
-		shm_unlink(manager->shmname);
-	}
-	if (manager->shmname)
-		bfree(manager->shmname);
+		munmap(manager->data, SHARED_HEADER_SIZE);
+	if (manager->fd != -1)
+		close(manager->fd);
+	if (manager->doorbell != -1)
+		close(manager->doorbell);
+	if (manager->blobs != NULL)
+		munmap(manager->blobs, manager->blobs_size);
+	if (manager->blob_fd != -1)
+		close(manager->blob_fd);
+	pthread_mutex_destroy(&manager->send_lock);
+	pthread_mutex_destroy(&manager->config_lock);
+	if (manager->cache_name)
+		bfree(manager->cache_name);
+	bfree(manager->config.url);
+	bfree(manager->config.css_file);
+	bfree(manager->config.js_file);
+	bfree(manager->name);
 	bfree(manager);
 }
 
-void lock_browser_manager(browser_manager_t* manager)
+/* must be set before the browser is started */
+void browser_manager_set_status_callback(browser_manager_t* manager, browser_status_cb callback,
+                                         void* param)
 {
-	pthread_mutex_lock(&manager->data->mutex);
+	manager->status_callback = callback;
+	manager->status_param = param;
 }
 
-void unlock_browser_manager(browser_manager_t* manager)
+uint32_t browser_manager_get_crashes(browser_manager_t* manager)
 {
-	pthread_mutex_unlock(&manager->data->mutex);
+	return __atomic_load_n(&manager->crashes, __ATOMIC_RELAXED);
 }
 
-uint8_t* get_browser_manager_data(browser_manager_t* manager)
+/* fills in the newest frame painted by the browser, or in fifo mode the
+ * oldest one not taken yet. Returns false if there is none matching the
+ * requested size. The frame stays valid until the next call. */
+bool browser_manager_get_frame(browser_manager_t* manager, uint32_t width, uint32_t height,
+                               browser_frame_t* frame)
 {
-	return &manager->data->data;
+	struct shared_data* data = manager->data;
+	uint32_t slot;
+
+	if (!browser_confirmed(manager))
+		return false;
+
+	manager->frame_seq = __atomic_load_n(&data->frame_seq, __ATOMIC_ACQUIRE);
+	if (data->frame_mode == SHARED_FRAME_MODE_FIFO) {
+		if (manager->fifo_taken) {
+			shared_fifo_pop(data);
+			manager->fifo_taken = false;
+		}
+		if (!shared_fifo_readable(data, &slot))
+			return false;
+		manager->fifo_taken = true;
+	} else {
+		shared_frame_acquire(data);
+		slot = data->frame_front;
+	}
+
+	shared_frame_t* shared = &data->frames[slot];
+	if (shared->generation == 0 || shared->layout != data->layout_generation
+	    || shared->width != width || shared->height != height)
+		return false;
+
+	frame->pixels = shared_frame_pixels(manager->frames, data->frame_size, slot);
+	frame->linesize = data->frame_pitch;
+	frame->generation = shared->generation;
+	frame->timestamp = shared->timestamp;
+	frame->damage_base = shared->damage_base;
+	frame->rect_count = shared->rect_count;
+	frame->rects = shared->rects;
+	manager->last_frame_ts = shared->timestamp;
+	if (manager->recover_ts && shared->timestamp >= manager->spawn_ts) {
+		blog(LOG_INFO,
+		     "%s: recovered %llu ms after the browser was lost, %u crashes so far",
+		     manager->name,
+		     (unsigned long long) (shared->timestamp - manager->recover_ts) / 1000000ULL,
+		     manager->crashes);
+		manager->recover_ts = 0;
+	}
+	if (manager->spawn_ts && shared->timestamp >= manager->spawn_ts) {
+		blog(LOG_INFO, "%s: first frame %llu ms after %s", manager->name,
+		     (unsigned long long) (shared->timestamp - manager->spawn_ts) / 1000000ULL,
+		     manager->prewarmed ? "claiming a prewarmed browser" : "browser start");
+		manager->spawn_ts = 0;
+	}
+	return true;
 }
 
-void browser_manager_change_url(browser_manager_t* manager, const char* url)
+#define TICK_GAP_NS 100000000ULL
+
+/* returns whether the browser published a frame since the last
+ * browser_manager_get_frame call. If not and one is due within wait_ns, waits
+ * for it so it does not show up a tick late. */
+bool browser_manager_frame_ready(browser_manager_t* manager, uint64_t wait_ns)
 {
-	if (manager->qid == -1)
-		return;
+	struct shared_data* data = manager->data;
+	uint32_t seq = __atomic_load_n(&data->frame_seq, __ATOMIC_ACQUIRE);
+	uint64_t now = shared_time_ns();
+	bool ticking = now - manager->tick_ts < TICK_GAP_NS;
+	manager->tick_ts = now;
+	if (seq != manager->frame_seq) {
+		/* frames painted over since the last tick, ticks after a pause
+		 * like a hidden source do not count */
+		if (ticking && data->frame_mode == SHARED_FRAME_MODE_LATEST)
+			manager->frames_dropped += seq - manager->frame_seq - 1;
+		return true;
+	}
+
+	uint64_t interval = 1000000000ULL / (data->fps > 0 ? data->fps : 1);
+	if (wait_ns > 0 && now + wait_ns >= manager->last_frame_ts + interval
+	    && shared_wait(&data->frame_seq, &data->frame_waiters, seq, wait_ns)) {
+		manager->frames_late++;
+		return true;
+	}
+
+	manager->frames_skipped++;
+	return false;
+}
+
+/* sleep until the browser publishes a frame after the last one handed out */
+bool browser_manager_wait_frame(browser_manager_t* manager, uint64_t timeout_ns)
+{
+	return shared_wait(&manager->data->frame_seq, &manager->data->frame_waiters,
+	                   manager->frame_seq, timeout_ns);
+}
+
+/* switch between handing out only the newest frame and every frame in
+ * order, frames queued so far are dropped */
+void browser_manager_set_frame_mode(browser_manager_t* manager, uint32_t mode)
+{
+	struct shared_data* data = manager->data;
+
+	shared_lock(&data->mutex);
+	if (data->frame_mode != mode) {
+		data->frame_mode = mode;
+		manager->fifo_taken = false;
+		__atomic_store_n(&data->fifo_tail, data->fifo_head, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&data->layout_generation, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&data->mutex);
+}
+
+/* fold msg into the input event queued last if the browser has not taken
+ * that yet, see browser_coalesce_message. Called with the send lock held. */
+static bool coalesce_message(browser_manager_t* manager, const browser_message_t* msg)
+{
+	if (!manager->coalesce_valid)
+		return false;
+
+	browser_message_t merged = manager->coalesce_last;
+	if (!browser_coalesce_message(&merged, msg))
+		return false;
+
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	size_t size = browser_encode_message(buf, sizeof(buf), &merged);
+	if (!shared_ring_replace(&manager->data->commands, manager->coalesce_pos, buf, size))
+		return false;
+
+	manager->coalesce_last = merged;
+	manager->events_merged++;
+	return true;
+}
+
+/* input events only matter while they are fresh, anything else carries
+ * state the browser must not miss */
+static bool message_droppable(const browser_message_t* msg)
+{
+	switch (msg->type) {
+	case MESSAGE_TYPE_MOUSE_CLICK:
+	case MESSAGE_TYPE_MOUSE_MOVE:
+	case MESSAGE_TYPE_MOUSE_WHEEL:
+	case MESSAGE_TYPE_KEY:
+	case MESSAGE_TYPE_BEGIN_FRAME:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	if (strlen(url) < (MAX_MESSAGE_SIZE - 1)) {
-		browser_message_t buf;
-		buf.text.type = MESSAGE_TYPE_URL;
-		strncpy(buf.text.text, url, MAX_MESSAGE_SIZE - 1);
+/* keep a message the ring did not take for flush_held. Called with the send
+ * lock held. */
+static void hold_message(browser_manager_t* manager, const browser_message_t* msg)
+{
+	switch (msg->type) {
+	case MESSAGE_TYPE_URL:
+	case MESSAGE_TYPE_CSS:
+	case MESSAGE_TYPE_JS:
+	case MESSAGE_TYPE_CONFIG:
+	case MESSAGE_TYPE_SCROLLBARS:
+	case MESSAGE_TYPE_ZOOM:
+	case MESSAGE_TYPE_SCROLL:
+		__atomic_store_n(&manager->resend_config, true, __ATOMIC_RELAXED);
+		break;
+	default:
+		if (msg->type >= 32)
+			return;
+		manager->held[msg->type] = *msg;
+		__atomic_or_fetch(&manager->held_types, 1u << msg->type, __ATOMIC_RELAXED);
+	}
+}
+
+/* queue the held messages as far as the ring takes them, returns false if
+ * some are left. Called with the send lock held. */
+static bool flush_held(browser_manager_t* manager)
+{
+	while (manager->held_types) {
+		uint8_t buf[MAX_MESSAGE_SIZE];
+		int type = __builtin_ctz(manager->held_types);
+		size_t size = browser_encode_message(buf, sizeof(buf), &manager->held[type]);
+		uint64_t pos;
+		if (size > 0 && !shared_ring_push(&manager->data->commands, buf, size, &pos))
+			return false;
+		__atomic_and_fetch(&manager->held_types, ~(1u << type), __ATOMIC_RELAXED);
+		manager->coalesce_valid = false;
+	}
+	return true;
+}
+
+/* queue an encoded message for the browser with the send lock held. Never
+ * blocks: if the browser fell so far behind that the ring is full an input
+ * event is dropped and anything else held for flush_held, false is returned
+ * either way. A size of 0 is a message that failed to encode. */
+static bool queue_message(browser_manager_t* manager, const uint8_t* msg, size_t size)
+{
+	browser_message_t decoded;
+
+	if (size == 0 || !browser_decode_message(msg, size, &decoded)) {
+		blog(LOG_WARNING, "%s: message too long, dropping it", manager->name);
+		return false;
+	}
+	if (coalesce_message(manager, &decoded))
+		return true;
+
+	/* held state goes first, a newer message of its kind must not overtake
+	 * it */
+	bool droppable = message_droppable(&decoded);
+	uint64_t pos;
+	if ((!flush_held(manager) && !droppable)
+	    || !shared_ring_push(&manager->data->commands, msg, size, &pos)) {
+		if (manager->messages_dropped++ == 0)
+			blog(LOG_WARNING, "%s: command queue full, holding back messages",
+			     manager->name);
+		if (!droppable)
+			hold_message(manager, &decoded);
+		return false;
+	}
+	manager->coalesce_valid = browser_message_coalescable(&decoded);
+	manager->coalesce_last = decoded;
+	manager->coalesce_pos = pos;
+	return true;
+}
+
+static void ring_doorbell(browser_manager_t* manager)
+{
+	if (shared_ring_needs_doorbell(&manager->data->commands))
+		eventfd_write(manager->doorbell, 1);
+}
+
+static bool send_message(browser_manager_t* manager, const uint8_t* msg, size_t size)
+{
+	pthread_mutex_lock(&manager->send_lock);
+	bool queued = queue_message(manager, msg, size);
+	pthread_mutex_unlock(&manager->send_lock);
+
+	if (queued)
+		ring_doorbell(manager);
+	return queued;
+}
+
+/* queue a url, css or js message with text in the blob arena */
+static bool send_text(browser_manager_t* manager, uint8_t type, const char* text)
+{
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	uint64_t offset;
+	uint32_t blob;
+	size_t size;
+
+	pthread_mutex_lock(&manager->send_lock);
+	if (!put_blob(manager, text, &offset, &blob)) {
+		pthread_mutex_unlock(&manager->send_lock);
+		return false;
+	}
+	if (type == MESSAGE_TYPE_URL)
+		size = browser_encode_url(buf, sizeof(buf), offset, blob);
+	else if (type == MESSAGE_TYPE_CSS)
+		size = browser_encode_css(buf, sizeof(buf), offset, blob);
+	else
+		size = browser_encode_js(buf, sizeof(buf), offset, blob);
+	bool queued = queue_message(manager, buf, size);
+	pthread_mutex_unlock(&manager->send_lock);
+
+	if (queued)
+		ring_doorbell(manager);
+	return queued;
+}
+
+static void replace_string(char** dst, const char* src)
+{
+	char* copy = bstrdup(src);
+	bfree(*dst);
+	*dst = copy;
+}
+
+/* records that the config changed in what bit stands for, returns true if
+ * that waits for browser_manager_commit_update. Called with the config lock
+ * held. */
+static bool defer_change(browser_manager_t* manager, uint32_t bit)
+{
+	if (manager->updating)
+		manager->pending |= bit;
+	return manager->updating;
+}
+
+/* from here on the setters below only record their values, which
+ * browser_manager_commit_update then sends as one snapshot */
+void browser_manager_begin_update(browser_manager_t* manager)
+{
+	pthread_mutex_lock(&manager->config_lock);
+	manager->updating = true;
+	manager->pending = 0;
+	pthread_mutex_unlock(&manager->config_lock);
+}
 
-		msgsnd(manager->qid, &buf, strlen(url) + 1, 0);
+/* a copy of the config for send_config, with the strings of the parts in
+ * changed duplicated and the others NULL. Called with the config lock
+ * held. */
+static browser_config_t copy_config(browser_manager_t* manager, uint32_t changed)
+{
+	browser_config_t config = manager->config;
+	config.url = changed & BROWSER_CONFIG_URL ? bstrdup(config.url) : NULL;
+	config.css_file = changed & BROWSER_CONFIG_CSS ? bstrdup(config.css_file) : NULL;
+	config.js_file = changed & BROWSER_CONFIG_JS ? bstrdup(config.js_file) : NULL;
+	return config;
+}
+
+/* queue a config message with the parts in pending, frees the strings of
+ * config */
+static void send_config(browser_manager_t* manager, browser_config_t config, uint32_t pending)
+{
+	char* css = read_text_file(config.css_file);
+	char* js = read_text_file(config.js_file);
+	uint64_t url_offset, css_offset, js_offset;
+	uint32_t url_blob, css_blob, js_blob;
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	bool queued = false;
+
+	pthread_mutex_lock(&manager->send_lock);
+	/* a partly written update leaves nothing behind in the arena */
+	uint64_t blob_head = manager->blob_head;
+	uint32_t blob_generation = manager->blob_generation;
+	if (put_blob(manager, config.url, &url_offset, &url_blob)
+	    && put_blob(manager, css, &css_offset, &css_blob)
+	    && put_blob(manager, js, &js_offset, &js_blob)) {
+		size_t size = browser_encode_config(
+		    buf, sizeof(buf), ++manager->config_version, pending, config.scrollbars,
+		    config.zoom, config.scroll_vertical, config.scroll_horizontal, url_offset,
+		    url_blob, css_offset, css_blob, js_offset, js_blob);
+		queued = queue_message(manager, buf, size);
 	} else {
-		uint8_t packages = ceil((double) strlen(url) / (double) (MAX_MESSAGE_SIZE - 3));
-
-		static uint8_t split_id = 0;
-		split_id++;
-		for (uint8_t i = 0; i < packages; i++) {
-			browser_message_t buf;
-			buf.split_text.id = split_id;
-			buf.split_text.count = i;
-			buf.split_text.max = packages;
-			buf.split_text.type = MESSAGE_TYPE_URL_LONG;
-
-			strncpy(buf.split_text.text, &url[i * (MAX_MESSAGE_SIZE - 3)],
-			        MAX_MESSAGE_SIZE - 3);
-			msgsnd(manager->qid, &buf, strlen(buf.split_text.text) + 3, 0);
-		}
+		manager->blob_head = blob_head;
+		manager->blob_generation = blob_generation;
 	}
+	pthread_mutex_unlock(&manager->send_lock);
+
+	if (queued)
+		ring_doorbell(manager);
+	bfree(config.url);
+	bfree(config.css_file);
+	bfree(config.js_file);
+	bfree(css);
+	bfree(js);
 }
 
-void browser_manager_change_css_file(browser_manager_t* manager, const char* css_file)
+void browser_manager_commit_update(browser_manager_t* manager)
+{
+	/* a copy, the config may change again while this is sent */
+	pthread_mutex_lock(&manager->config_lock);
+	uint32_t pending = manager->pending;
+	browser_config_t config = copy_config(manager, pending);
+	manager->updating = false;
+	manager->pending = 0;
+	pthread_mutex_unlock(&manager->config_lock);
+	if (pending)
+		send_config(manager, config, pending);
+}
+
+/* send what a full command ring did not take once there is room, the page
+ * state as a whole snapshot. Run by the status thread. */
+static void send_held(browser_manager_t* manager)
+{
+	pthread_mutex_lock(&manager->send_lock);
+	bool held = manager->held_types != 0;
+	bool flushed = flush_held(manager);
+	bool resend = flushed && manager->resend_config;
+	if (resend)
+		__atomic_store_n(&manager->resend_config, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&manager->send_lock);
+
+	if (held)
+		ring_doorbell(manager);
+	if (resend) {
+		pthread_mutex_lock(&manager->config_lock);
+		browser_config_t config = copy_config(manager, BROWSER_CONFIG_ALL);
+		pthread_mutex_unlock(&manager->config_lock);
+		send_config(manager, config, BROWSER_CONFIG_ALL);
+	}
+}
+
+void browser_manager_change_url(browser_manager_t* manager, const char* url)
 {
-	if (manager->qid == -1)
+	pthread_mutex_lock(&manager->config_lock);
+	replace_string(&manager->config.url, url);
+	bool deferred = defer_change(manager, BROWSER_CONFIG_URL);
+	pthread_mutex_unlock(&manager->config_lock);
+	if (deferred)
 		return;
 
-	browser_message_t buf;
-	buf.text.type = MESSAGE_TYPE_CSS;
-	strncpy(buf.text.text, css_file, MAX_MESSAGE_SIZE);
+	send_text(manager, MESSAGE_TYPE_URL, url);
+}
+
+/* the file is read here and its contents sent, so a reload picks up
+ * changes */
+void browser_manager_change_css_file(browser_manager_t* manager, const char* css_file)
+{
+	pthread_mutex_lock(&manager->config_lock);
+	replace_string(&manager->config.css_file, css_file);
+	bool deferred = defer_change(manager, BROWSER_CONFIG_CSS);
+	pthread_mutex_unlock(&manager->config_lock);
+	if (deferred)
+		return;
 
-	msgsnd(manager->qid, &buf, strlen(css_file) + 1, 0);
+	char* css = read_text_file(css_file);
+	send_text(manager, MESSAGE_TYPE_CSS, css);
+	bfree(css);
 }
 
 void browser_manager_change_js_file(browser_manager_t* manager, const char* js_file)
 {
-	if (manager->qid < 0)
+	pthread_mutex_lock(&manager->config_lock);
+	replace_string(&manager->config.js_file, js_file);
+	bool deferred = defer_change(manager, BROWSER_CONFIG_JS);
+	pthread_mutex_unlock(&manager->config_lock);
+	if (deferred)
 		return;
 
-	browser_message_t buf;
-	buf.text.type = MESSAGE_TYPE_JS;
-	strncpy(buf.text.text, js_file, MAX_MESSAGE_SIZE);
-
-	msgsnd(manager->qid, &buf, strlen(js_file) + 1, 0);
+	char* js = read_text_file(js_file);
+	send_text(manager, MESSAGE_TYPE_JS, js);
+	bfree(js);
 }
 
 void browser_manager_change_size(browser_manager_t* manager, uint32_t width, uint32_t height)
 {
-	pthread_mutex_lock(&manager->data->mutex);
+	shared_lock(&manager->data->mutex);
+	layout_frames(manager, width, height);
+	pthread_mutex_unlock(&manager->data->mutex);
 
-	manager->data->width = width;
-	manager->data->height = height;
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_size(buf, sizeof(buf)));
+}
 
-	if (manager->qid == -1)
+/* changes the rate the browser renders at without restarting it, static
+ * pages go down to fps_idle */
+void browser_manager_set_fps(browser_manager_t* manager, int fps, int fps_idle)
+{
+	shared_lock(&manager->data->mutex);
+	bool changed = manager->data->fps != fps || manager->data->fps_idle != fps_idle;
+	manager->data->fps = fps;
+	manager->data->fps_idle = fps_idle;
+	pthread_mutex_unlock(&manager->data->mutex);
+	if (!changed)
 		return;
 
-	browser_message_t buf;
-	buf.generic.type = MESSAGE_TYPE_SIZE;
-	msgsnd(manager->qid, &buf, 0, 0);
-
-	pthread_mutex_unlock(&manager->data->mutex);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_fps(buf, sizeof(buf)));
 }
 
 void browser_manager_set_scrollbars(browser_manager_t* manager, bool show)
 {
-	if (manager->qid == -1)
+	pthread_mutex_lock(&manager->config_lock);
+	manager->config.scrollbars = show;
+	bool deferred = defer_change(manager, BROWSER_CONFIG_SCROLLBARS);
+	pthread_mutex_unlock(&manager->config_lock);
+	if (deferred)
 		return;
 
-	browser_message_t buf;
-	buf.generic_state.type = MESSAGE_TYPE_SCROLLBARS;
-	buf.generic_state.state = show;
-	msgsnd(manager->qid, &buf, 1, 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_scrollbars(buf, sizeof(buf), show));
 }
 
 void browser_manager_set_zoom(browser_manager_t* manager, uint32_t zoom)
 {
-	if (manager->qid == -1)
+	pthread_mutex_lock(&manager->config_lock);
+	manager->config.zoom = zoom;
+	bool deferred = defer_change(manager, BROWSER_CONFIG_ZOOM);
+	pthread_mutex_unlock(&manager->config_lock);
+	if (deferred)
 		return;
 
-	browser_message_t buf;
-	buf.zoom.type = MESSAGE_TYPE_ZOOM;
-	buf.zoom.zoom = zoom;
-	msgsnd(manager->qid, &buf, sizeof(zoom), 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_zoom(buf, sizeof(buf), zoom));
 }
 
 void browser_manager_set_scroll(browser_manager_t* manager, uint32_t vertical, uint32_t horizontal)
 {
-	if (manager->qid == -1)
+	pthread_mutex_lock(&manager->config_lock);
+	manager->config.scroll_vertical = vertical;
+	manager->config.scroll_horizontal = horizontal;
+	bool deferred = defer_change(manager, BROWSER_CONFIG_SCROLL);
+	pthread_mutex_unlock(&manager->config_lock);
+	if (deferred)
 		return;
 
-	browser_message_t buf;
-	buf.scroll.type = MESSAGE_TYPE_SCROLL;
-	buf.scroll.vertical = vertical;
-	buf.scroll.horizontal = horizontal;
-	msgsnd(manager->qid, &buf, sizeof(vertical) + sizeof(horizontal), 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_scroll(buf, sizeof(buf), vertical, horizontal));
 }
 
 void browser_manager_reload_page(browser_manager_t* manager)
 {
-	if (manager->qid == -1)
-		return;
-
-	browser_message_t buf;
-	buf.generic.type = MESSAGE_TYPE_RELOAD;
-	msgsnd(manager->qid, &buf, 0, 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_reload(buf, sizeof(buf)));
 }
 
 void browser_manager_restart_browser(browser_manager_t* manager)
 {
-	pthread_mutex_lock(&manager->data->mutex);
+	detach_host(manager);
+	shared_lock(&manager->data->mutex);
 	kill_renderer(manager);
 	spawn_renderer(manager);
 	pthread_mutex_unlock(&manager->data->mutex);
@@ -354,7 +1836,7 @@ void browser_manager_restart_browser(browser_manager_t* manager)
 
 void browser_manager_start_browser(browser_manager_t* manager)
 {
-	pthread_mutex_lock(&manager->data->mutex);
+	shared_lock(&manager->data->mutex);
 	// TODO Double spawn prevention?
 	spawn_renderer(manager);
 	pthread_mutex_unlock(&manager->data->mutex);
@@ -362,111 +1844,95 @@ void browser_manager_start_browser(browser_manager_t* manager)
 
 void browser_manager_stop_browser(browser_manager_t* manager)
 {
-	pthread_mutex_lock(&manager->data->mutex);
+	detach_host(manager);
+	shared_lock(&manager->data->mutex);
 	// TODO Double kill prevention?
 	kill_renderer(manager);
 	pthread_mutex_unlock(&manager->data->mutex);
 }
 
-void browser_manager_send_mouse_click(browser_manager_t* manager, int32_t x, int32_t y,
-                                      uint32_t modifiers, int32_t button_type, bool mouse_up,
-                                      uint32_t click_count)
+/* hides the browser from CEF in place, unlike stopping it the page keeps
+ * its state and comes back without a reload */
+void browser_manager_set_suspended(browser_manager_t* manager, bool suspended)
 {
-	if (manager->qid == -1)
+	pthread_mutex_lock(&manager->config_lock);
+	bool changed = manager->suspended != suspended;
+	manager->suspended = suspended;
+	pthread_mutex_unlock(&manager->config_lock);
+	if (!changed)
 		return;
 
-	browser_message_t buf;
-	buf.mouse_click.type = MESSAGE_TYPE_MOUSE_CLICK;
-	buf.mouse_click.x = x;
-	buf.mouse_click.y = y;
-	buf.mouse_click.modifiers = modifiers;
-	buf.mouse_click.button_type = button_type;
-	buf.mouse_click.mouse_up = mouse_up;
-	buf.mouse_click.click_count = click_count;
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_suspend(buf, sizeof(buf), suspended));
+}
 
-	msgsnd(manager->qid, &buf, sizeof(buf), 0);
+/* takes effect with the next browser start, returns whether it changed */
+bool browser_manager_set_begin_frame(browser_manager_t* manager, bool begin_frame)
+{
+	pthread_mutex_lock(&manager->config_lock);
+	bool changed = manager->begin_frame != begin_frame;
+	manager->begin_frame = begin_frame;
+	pthread_mutex_unlock(&manager->config_lock);
+	return changed;
 }
 
-void browser_manager_send_mouse_move(browser_manager_t* manager, int32_t x, int32_t y,
-                                     uint32_t modifiers, bool mouse_leave)
+/* has a browser started with begin_frame paint once, requests it did not get
+ * to yet are merged */
+void browser_manager_request_frame(browser_manager_t* manager)
 {
-	if (manager->qid == -1)
-		return;
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_begin_frame(buf, sizeof(buf)));
+}
 
-	// struct mouse_move_message buf;
-	browser_message_t buf;
-	buf.mouse_move.type = MESSAGE_TYPE_MOUSE_MOVE;
-	buf.mouse_move.x = x;
-	buf.mouse_move.y = y;
-	buf.mouse_move.modifiers = modifiers;
-	buf.mouse_move.mouse_leave = mouse_leave;
+void browser_manager_send_mouse_click(browser_manager_t* manager, int32_t x, int32_t y,
+                                      uint32_t modifiers, int32_t button_type, bool mouse_up,
+                                      uint32_t click_count)
+{
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf,
+	             browser_encode_mouse_click(buf, sizeof(buf), x, y, modifiers, button_type,
+	                                        mouse_up, click_count));
+}
 
-	msgsnd(manager->qid, &buf, sizeof(buf), 0);
+void browser_manager_send_mouse_move(browser_manager_t* manager, int32_t x, int32_t y,
+                                     uint32_t modifiers, bool mouse_leave)
+{
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf,
+	             browser_encode_mouse_move(buf, sizeof(buf), x, y, modifiers, mouse_leave));
 }
 
 void browser_manager_send_mouse_wheel(browser_manager_t* manager, int32_t x, int32_t y,
                                       uint32_t modifiers, int x_delta, int y_delta)
 {
-	if (manager->qid == -1)
-		return;
-
-	browser_message_t buf;
-	buf.mouse_wheel.type = MESSAGE_TYPE_MOUSE_WHEEL;
-	buf.mouse_wheel.x = x;
-	buf.mouse_wheel.y = y;
-	buf.mouse_wheel.modifiers = modifiers;
-	buf.mouse_wheel.x_delta = x_delta;
-	buf.mouse_wheel.y_delta = y_delta;
-
-	msgsnd(manager->qid, &buf, sizeof(buf), 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf,
+	             browser_encode_mouse_wheel(buf, sizeof(buf), x, y, modifiers, x_delta,
+	                                        y_delta));
 }
 
 void browser_manager_send_focus(browser_manager_t* manager, bool focus)
 {
-	if (manager->qid == -1)
-		return;
-
-	browser_message_t buf;
-	buf.focus.type = MESSAGE_TYPE_FOCUS;
-	buf.focus.focus = focus;
-
-	msgsnd(manager->qid, &buf, sizeof(buf), 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_focus(buf, sizeof(buf), focus));
 }
 
 void browser_manager_send_key(browser_manager_t* manager, bool key_up, uint32_t native_vkey,
                               uint32_t modifiers, char chr)
 {
-	if (manager->qid == -1)
-		return;
-
-	browser_message_t buf;
-	buf.key.type = MESSAGE_TYPE_KEY;
-	buf.key.key_up = key_up;
-	buf.key.native_vkey = native_vkey;
-	buf.key.modifiers = modifiers;
-	buf.key.chr = chr;
-
-	msgsnd(manager->qid, &buf, sizeof(buf), 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf,
+	             browser_encode_key(buf, sizeof(buf), key_up, native_vkey, modifiers, chr));
 }
 
 void browser_manager_send_active_state_change(browser_manager_t* manager, bool active)
 {
-	if (manager->qid == -1)
-		return;
-
-	browser_message_t buf;
-	buf.active_state.type = MESSAGE_TYPE_ACTIVE_STATE_CHANGE;
-	buf.active_state.active = active;
-	msgsnd(manager->qid, &buf, sizeof(buf), 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_active_state(buf, sizeof(buf), active));
 }
 
 void browser_manager_send_visibility_change(browser_manager_t* manager, bool visible)
 {
-	if (manager->qid == -1)
-		return;
-
-	browser_message_t buf;
-	buf.visibility.type = MESSAGE_TYPE_VISIBILITY_CHANGE;
-	buf.visibility.visible = visible;
-	msgsnd(manager->qid, &buf, sizeof(buf), 0);
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	send_message(manager, buf, browser_encode_visibility(buf, sizeof(buf), visible));
 }
@@ -24,27 +24,139 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #define blog(level, msg, ...) blog(level, "obs-linuxbrowser: " msg, ##__VA_ARGS__)
 
+/* called on the manager's status thread for every report the browser sends,
+ * see MESSAGE_TYPE_LOAD_START and following */
+typedef void (*browser_status_cb)(void* param, const browser_message_t* msg);
+
+/* the page state last handed to the browser, a restarted browser starts out
+ * with it */
+typedef struct browser_config {
+	char* url;
+	char* css_file;
+	char* js_file;
+	bool scrollbars;
+	uint32_t zoom;
+	uint32_t scroll_vertical;
+	uint32_t scroll_horizontal;
+} browser_config_t;
+
 typedef struct browser_manager {
 	int fd;
 	int pid;
-	int qid;
-	char* shmname;
+	int doorbell;
+	pthread_mutex_t send_lock;
+	uint64_t messages_dropped;
+	/* the last queued message, as long as it is an input event later ones
+	 * may still be merged into */
+	bool coalesce_valid;
+	browser_message_t coalesce_last;
+	uint64_t coalesce_pos;
+	uint64_t events_merged;
+	/* what a full command ring did not take besides input events, which are
+	 * simply dropped: the newest message of each type in held_types, and
+	 * resend_config for a lost url, css, js or view change, which a fresh
+	 * config snapshot makes up for. Sent once there is room again, under
+	 * the send lock. */
+	uint32_t held_types;
+	browser_message_t held[32];
+	bool resend_config;
+	/* the blob arena, see shared_blob_t */
+	int blob_fd;
+	uint8_t* blobs;
+	size_t blobs_size;
+	uint64_t blob_head;
+	uint32_t blob_generation;
+	/* between browser_manager_begin_update and browser_manager_commit_update
+	 * pending collects the BROWSER_CONFIG_* bits of what changed. The
+	 * config lock guards these, the config, suspended and begin_frame,
+	 * which the setters on the UI, video and hotkey threads change while a
+	 * watchdog restart on the status thread reads them. Taken after the
+	 * send lock, never the other way around. */
+	pthread_mutex_t config_lock;
+	bool updating;
+	uint32_t pending;
+	browser_config_t config;
+	uint32_t config_version;
+	bool confirmed;
+	char* name;
+	char* cache_name;
 	obs_data_t* settings;
 	struct shared_data* data;
+	uint8_t* frames;
+	size_t frames_size;
+	bool fifo_taken;
+	uint32_t frame_seq;
+	uint64_t last_frame_ts;
+	uint64_t frames_skipped;
+	uint64_t frames_late;
+	uint64_t frames_dropped;
+	uint64_t tick_ts;
+	uint64_t spawn_ts;
+	uint64_t started_ts;
 	bool spawned;
+	bool suspended;
+	/* the browser paints on browser_manager_request_frame */
+	bool begin_frame;
+	/* the browser came out of the pool */
+	bool prewarmed;
+	/* the last browser kill_renderer handed to the reaper. While it is still
+	 * around the next browser waits with launch_pending set. */
+	int dying_pid;
+	bool launch_pending;
+	/* set while the browser lives in the shared host, under host_id */
+	bool shared_host;
+	uint32_t host_id;
+	int host_pid;
+	/* watchdog state, see WATCHDOG_INTERVAL_MS. lost_pid is set while a
+	 * restart is pending, recover_ts until the new browser paints */
+	uint32_t crashes;
+	uint32_t crash_streak;
+	int lost_pid;
+	uint64_t lost_ts;
+	uint64_t recover_at;
+	uint64_t recover_ts;
+	int status_doorbell;
+	pthread_t status_thread;
+	bool status_stop;
+	browser_status_cb status_callback;
+	void* status_param;
 } browser_manager_t;
 
+typedef struct browser_frame {
+	const uint8_t* pixels;
+	uint32_t linesize;
+	uint64_t generation;
+	uint64_t timestamp;
+	/* rects hold every change since this frame */
+	uint64_t damage_base;
+	uint32_t rect_count;
+	const shared_rect_t* rects;
+} browser_frame_t;
+
 browser_manager_t* create_browser_manager(uint32_t width, uint32_t height, int fps,
                                           obs_data_t* settings, const char* uid);
 void destroy_browser_manager(browser_manager_t* manager);
-void lock_browser_manager(browser_manager_t* manager);
-void unlock_browser_manager(browser_manager_t* manager);
-uint8_t* get_browser_manager_data(browser_manager_t* manager);
+void browser_manager_remove_stale_segments(void);
+void browser_manager_init_pool(int size);
+void browser_manager_free_pool(void);
+void browser_manager_stop_reaper(void);
+void browser_manager_stop_launcher(void);
+void browser_manager_set_status_callback(browser_manager_t* manager, browser_status_cb callback,
+                                         void* param);
+uint32_t browser_manager_get_crashes(browser_manager_t* manager);
+bool browser_manager_get_frame(browser_manager_t* manager, uint32_t width, uint32_t height,
+                               browser_frame_t* frame);
+void browser_manager_set_frame_mode(browser_manager_t* manager, uint32_t mode);
+bool browser_manager_frame_ready(browser_manager_t* manager, uint64_t wait_ns);
+bool browser_manager_wait_frame(browser_manager_t* manager, uint64_t timeout_ns);
 
+void browser_manager_begin_update(browser_manager_t* manager);
+void browser_manager_commit_update(browser_manager_t* manager);
 void browser_manager_change_url(browser_manager_t* manager, const char* url);
 void browser_manager_change_css_file(browser_manager_t* manager, const char* css_file);
 void browser_manager_change_js_file(browser_manager_t* manager, const char* js_file);
 void browser_manager_change_size(browser_manager_t* manager, uint32_t width, uint32_t height);
+void browser_manager_set_fps(browser_manager_t* manager, int fps, int fps_idle);
 void browser_manager_set_scrollbars(browser_manager_t* manager, bool show);
 void browser_manager_set_zoom(browser_manager_t* manager, uint32_t zoom);
 void browser_manager_set_scroll(browser_manager_t* manager, uint32_t vertical, uint32_t horizontal);
@@ -52,6 +164,9 @@ void browser_manager_reload_page(browser_manager_t* manager);
 void browser_manager_restart_browser(browser_manager_t* manager);
 void browser_manager_start_browser(browser_manager_t* manager);
 void browser_manager_stop_browser(browser_manager_t* manager);
+void browser_manager_set_suspended(browser_manager_t* manager, bool suspended);
+bool browser_manager_set_begin_frame(browser_manager_t* manager, bool begin_frame);
+void browser_manager_request_frame(browser_manager_t* manager);
 
 void browser_manager_send_mouse_click(browser_manager_t* manager, int32_t x, int32_t y,
                                       uint32_t modifiers, int32_t button_type, bool mouse_up,
@@ -17,205 +17,469 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #pragma once
 
-#define SHM_NAME "/linuxbrowser"
-#define SHM_MAX 50
+/* per source cache directory, also the prefix of the named shm segments
+ * older versions left in /dev/shm */
+#define CACHE_NAME "/linuxbrowser"
+#define CACHE_NAME_MAX 50
 
-#define MAX_BROWSER_WIDTH 4096
-#define MAX_BROWSER_HEIGHT 4096
-#define MAX_DATA_SIZE MAX_BROWSER_WIDTH* MAX_BROWSER_HEIGHT * 4
+#define MAX_BROWSER_WIDTH 16384
+#define MAX_BROWSER_HEIGHT 16384
 
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "messages.h"
+
+/* frames are exchanged through a triple buffer: the browser always owns
+ * frame_back, the plugin always owns frame_front and the third slot is parked
+ * in frame_exchange. Swapping a slot in or out is a single atomic exchange, so
+ * neither side ever waits for the other. */
+#define SHARED_FRAME_SLOTS 3
+/* set in frame_exchange while the parked slot holds a frame the plugin has
+ * not picked up yet */
+#define SHARED_FRAME_FRESH 0x4
+#define SHARED_FRAME_SLOT_MASK 0x3
+
+#define SHARED_MAX_DIRTY_RECTS 16
+#define SHARED_PAGE_SIZE 4096
+#define SHARED_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SHARED_ROUND(x, align) (((x) + (align) - 1) & ~((size_t)(align) - 1))
+#define SHARED_ROUND_PAGE(x) SHARED_ROUND(x, SHARED_PAGE_SIZE)
+/* frame rows start on a cache line so that the browser can stream them out
+ * with aligned vector stores */
+#define SHARED_PITCH_ALIGN 64
+
+/* the segment is an anonymous memfd handed to the browser over a socketpair
+ * whose end is passed on the command line, followed by the eventfd that rings
+ * the browser when commands are queued, the blob arena and the eventfd the
+ * browser rings when it queued status reports. The message carrying them
+ * holds a shared_attach_t. */
+#define SHARED_IPC_MAX_FDS 4
+
+/* a browser started for a single source gets one SHARED_ATTACH. The shared
+ * host serving every source with the shared_host setting gets one per source
+ * under an id of the plugin's choosing and a SHARED_DETACH without fds once
+ * the source stops. */
+#define SHARED_ATTACH 1
+#define SHARED_DETACH 2
+/* sent without fds to a browser the plugin keeps idle in its pool, so that it
+ * sets CEF up before it has a source. Its SHARED_ATTACH follows once a source
+ * claims it. */
+#define SHARED_IDLE 3
+/* set on every message to the shared host, which quits once the plugin closes
+ * its end of the socket */
+#define SHARED_ATTACH_HOST 0x1
+
+typedef struct shared_attach {
+	/* the plugin's BROWSER_PROTOCOL_VERSION */
+	uint32_t version;
+	uint32_t op;
+	uint32_t id;
+	uint32_t flags;
+} shared_attach_t;
+
+#define SHARED_RING_SIZE (64 * 1024)
+
+#define SHARED_HEARTBEAT_MS 1000
+
+typedef struct shared_rect {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+} shared_rect_t;
+
+/* rects cover every pixel that changed between frame damage_base and this
+ * frame, anyone holding an older frame has to take the whole frame */
+typedef struct shared_frame {
+	uint64_t generation;
+	/* CLOCK_MONOTONIC time of the paint */
+	uint64_t timestamp;
+	uint64_t damage_base;
+	uint32_t layout;
+	uint32_t width;
+	uint32_t height;
+	uint32_t rect_count;
+	shared_rect_t rects[SHARED_MAX_DIRTY_RECTS];
+} shared_frame_t;
+
+/* single producer, single consumer byte ring carrying encoded messages,
+ * commands from the plugin to the browser and status reports back. Every
+ * record is a uint32_t size and a uint32_t state followed by the message,
+ * padded to 8 bytes. head and tail only ever grow and sit on their own cache
+ * lines. */
+typedef struct shared_ring {
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	/* set by the consumer before it blocks on the doorbell */
+	uint32_t sleeping;
+	/* input events the consumer merged while draining */
+	uint64_t merged;
+	uint8_t data[SHARED_RING_SIZE] __attribute__((aligned(64)));
+} shared_ring_t;
+
+/* urls and css and js contents go through a second memfd, the blob arena,
+ * as a shared_blob_t followed by size bytes. Messages refer to a blob by its
+ * offset and generation, generation 0 stands for an empty text. Once the
+ * browser copied a blob out it stores the generation in blob_done, and the
+ * plugin starts over at the beginning of the arena when every blob written so
+ * far is done. */
+typedef struct shared_blob {
+	uint64_t size;
+	uint32_t generation;
+} shared_blob_t;
+
+#define SHARED_BLOB_ALIGN 64
+#define SHARED_BLOB_ARENA_MIN (1024 * 1024)
+
+/* the page state a browser starts out with, written by the plugin before it
+ * spawns the process. changed holds the BROWSER_CONFIG_* bits that are
+ * valid, url, css and js are blobs. cache is the blob of the source's cache
+ * name, queued before the others, which a browser that was not started with
+ * that name gives the source a request context of its own for. suspended
+ * starts the browser the way MESSAGE_TYPE_SUSPEND leaves it, begin_frame
+ * has it paint only on MESSAGE_TYPE_BEGIN_FRAME. */
+typedef struct shared_startup {
+	uint64_t cache_offset;
+	uint32_t cache_blob;
+	uint32_t changed;
+	bool scrollbars;
+	uint32_t zoom;
+	uint32_t scroll_vertical;
+	uint32_t scroll_horizontal;
+	bool suspended;
+	bool begin_frame;
+	uint64_t url_offset;
+	uint32_t url_blob;
+	uint64_t css_offset;
+	uint32_t css_blob;
+	uint64_t js_offset;
+	uint32_t js_blob;
+} shared_startup_t;
 
 typedef struct shared_data {
+	/* kept first so that they stay put whatever else changes. The browser
+	 * copies BROWSER_PROTOCOL_VERSION into browser_protocol once it agreed
+	 * to the version the plugin sent along with the segment. */
+	uint32_t browser_protocol;
+
+	/* robust, take it with shared_lock */
 	pthread_mutex_t mutex;
-	int qid;
 	int fps;
+	/* the browser renders static pages at down to this rate, 0 keeps it at
+	 * fps */
+	int fps_idle;
 	uint32_t width;
 	uint32_t height;
-	uint8_t data;
+	/* version of the last config message the browser has applied */
+	uint32_t config_version;
+	/* bumped by the plugin for every browser it starts on the segment. A
+	 * browser only touches the segment while owner holds the value it found
+	 * when it attached, so one that is still winding down leaves its
+	 * replacement alone. */
+	uint32_t owner;
+	/* shared_time_ns of the browser's UI thread, refreshed every
+	 * SHARED_HEARTBEAT_MS while it is not stuck */
+	uint64_t heartbeat;
+	shared_startup_t startup;
+	uint32_t blob_done;
+
+	/* the frame slots live behind the header and are sized for the current
+	 * width and height. The plugin changes them under the mutex and bumps
+	 * layout_generation; frame_area_size only ever grows, shrinking just
+	 * gives the pages back. */
+	uint32_t layout_generation;
+	bool huge_pages;
+	uint32_t frame_pitch;
+	uint64_t frame_size;
+	uint64_t frame_area_size;
+
+	/* in SHARED_FRAME_MODE_FIFO the slots form a queue instead of a triple
+	 * buffer and the browser waits for a free slot rather than overwrite a
+	 * frame the plugin has not taken yet */
+	uint32_t frame_mode;
+	uint64_t fifo_head;
+	uint64_t fifo_tail;
+
+	/* futex words bumped whenever a frame is published and whenever the
+	 * plugin frees a fifo slot, the waiter counts let the other side skip
+	 * the wake syscall when nobody sleeps */
+	uint32_t frame_seq;
+	uint32_t frame_waiters;
+	uint32_t fifo_seq;
+	uint32_t fifo_waiters;
+
+	uint32_t frame_back;
+	uint32_t frame_exchange;
+	uint32_t frame_front;
+	uint64_t frame_generation;
+	shared_frame_t frames[SHARED_FRAME_SLOTS];
+
+	shared_ring_t commands;
+	shared_ring_t status;
 } shared_data_t;
 
-#define MAX_MESSAGE_SIZE 1024
-#define MESSAGE_TYPE_URL 1
-#define MESSAGE_TYPE_SIZE 2
-#define MESSAGE_TYPE_RELOAD 3
-#define MESSAGE_TYPE_CSS 4
-#define MESSAGE_TYPE_MOUSE_CLICK 5
-#define MESSAGE_TYPE_MOUSE_MOVE 6
-#define MESSAGE_TYPE_MOUSE_WHEEL 7
-#define MESSAGE_TYPE_FOCUS 8
-#define MESSAGE_TYPE_KEY 9
-#define MESSAGE_TYPE_SCROLLBARS 10
-#define MESSAGE_TYPE_ZOOM 11
-#define MESSAGE_TYPE_SCROLL 12
-#define MESSAGE_TYPE_ACTIVE_STATE_CHANGE 13
-#define MESSAGE_TYPE_VISIBILITY_CHANGE 14
-#define MESSAGE_TYPE_URL_LONG 15
-#define MESSAGE_TYPE_JS 16
-
-typedef union {
-	struct {
-		long type;
-		uint8_t data[MAX_MESSAGE_SIZE];
-	} generic;
-
-	struct {
-		long type;
-		bool state;
-	} generic_state;
-
-	struct {
-		long type;
-		char text[MAX_MESSAGE_SIZE];
-	} text;
-
-	struct {
-		long type;
-		uint8_t id;
-		uint8_t count;
-		uint8_t max;
-		char text[MAX_MESSAGE_SIZE - 3];
-	} split_text;
-
-	struct {
-		long type;
-		int32_t x;
-		int32_t y;
-		uint32_t modifiers;
-		int32_t button_type;
-		bool mouse_up;
-		uint32_t click_count;
-	} mouse_click;
-
-	struct {
-		long type;
-		int32_t x;
-		int32_t y;
-		uint32_t modifiers;
-		bool mouse_leave;
-	} mouse_move;
-
-	struct {
-		long type;
-		int32_t x;
-		int32_t y;
-		uint32_t modifiers;
-		int x_delta;
-		int y_delta;
-	} mouse_wheel;
-
-	struct {
-		long type;
-		bool focus;
-	} focus;
-
-	struct {
-		long type;
-		bool key_up;
-		uint32_t native_vkey;
-		uint32_t modifiers;
-		char chr;
-	} key;
-
-	struct {
-		long type;
-		uint32_t zoom;
-	} zoom;
-
-	struct {
-		long type;
-		uint32_t vertical;
-		uint32_t horizontal;
-	} scroll;
-
-	struct {
-		long type;
-		bool active;
-	} active_state;
-
-	struct {
-		long type;
-		bool visible;
-	} visibility;
-} browser_message_t;
-
-// struct generic_message {
-// 	long type;
-// 	uint8_t data[MAX_MESSAGE_SIZE];
-// };
-//
-// struct text_message {
-// 	long type;
-// 	char text[MAX_MESSAGE_SIZE];
-// };
-//
-// struct split_text_message {
-// 	long type;
-// 	uint8_t id;
-// 	uint8_t count;
-// 	uint8_t max;
-// 	char text[MAX_MESSAGE_SIZE - 3];
-// };
-//
-// struct mouse_click_message {
-// 	long type;
-// 	int32_t x;
-// 	int32_t y;
-// 	uint32_t modifiers;
-// 	int32_t button_type;
-// 	bool mouse_up;
-// 	uint32_t click_count;
-// };
-//
-// struct mouse_move_message {
-// 	long type;
-// 	int32_t x;
-// 	int32_t y;
-// 	uint32_t modifiers;
-// 	bool mouse_leave;
-// };
-//
-// struct mouse_wheel_message {
-// 	long type;
-// 	int32_t x;
-// 	int32_t y;
-// 	uint32_t modifiers;
-// 	int x_delta;
-// 	int y_delta;
-// };
-//
-// struct focus_message {
-// 	long type;
-// 	bool focus;
-// };
-//
-// struct key_message {
-// 	long type;
-// 	bool key_up;
-// 	uint32_t native_vkey;
-// 	uint32_t modifiers;
-// 	char chr;
-// };
-//
-// struct zoom_message {
-// 	long type;
-// 	uint32_t zoom;
-// };
-//
-// struct scroll_message {
-// 	long type;
-// 	uint32_t vertical;
-// 	uint32_t horizontal;
-// };
-//
-// struct active_state_message {
-// 	long type;
-// 	bool active;
-// };
-//
-// struct visibility_message {
-// 	long type;
-// 	bool visible;
-// };
+#define SHARED_FRAME_MODE_LATEST 0
+#define SHARED_FRAME_MODE_FIFO 1
+
+#define SHARED_HEADER_SIZE SHARED_ROUND_PAGE(sizeof(shared_data_t))
+/* frames start on a huge page boundary of the segment so that transparent
+ * huge pages can back them */
+#define SHARED_FRAME_OFFSET SHARED_HUGE_PAGE_SIZE
+
+static inline uint64_t shared_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/* lock the segment's mutex. A browser killed while holding it leaves it to
+ * the next taker, which makes it usable again; what it guards are plain
+ * values that are each written whole. */
+static inline void shared_lock(pthread_mutex_t* mutex)
+{
+	if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+		pthread_mutex_consistent(mutex);
+}
+
+/* wake everyone sleeping on seq, see shared_wait */
+static inline void shared_signal(uint32_t* seq, uint32_t* waiters)
+{
+	__atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* sleep until seq moves on from old or timeout_ns passed, returns whether it
+ * moved. Works across processes since the words live in the shared mapping. */
+static inline bool shared_wait(uint32_t* seq, uint32_t* waiters, uint32_t old,
+                               uint64_t timeout_ns)
+{
+	uint64_t deadline = shared_time_ns() + timeout_ns;
+
+	__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(seq, __ATOMIC_SEQ_CST) == old) {
+		uint64_t now = shared_time_ns();
+		if (now >= deadline)
+			break;
+		struct timespec ts = {(time_t)((deadline - now) / 1000000000ULL),
+		                      (long) ((deadline - now) % 1000000000ULL)};
+		syscall(SYS_futex, seq, FUTEX_WAIT, old, &ts, NULL, 0);
+	}
+	__atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE) != old;
+}
+
+static inline uint32_t shared_frame_pitch(uint32_t width)
+{
+	return SHARED_ROUND((size_t) width * 4, SHARED_PITCH_ALIGN);
+}
+
+static inline size_t shared_frame_size(uint32_t width, uint32_t height, bool huge_pages)
+{
+	size_t size = (size_t) shared_frame_pitch(width) * height;
+	if (huge_pages && size >= SHARED_HUGE_PAGE_SIZE)
+		return SHARED_ROUND(size, SHARED_HUGE_PAGE_SIZE);
+	return SHARED_ROUND_PAGE(size);
+}
+
+static inline void shared_frames_init(shared_data_t* data)
+{
+	data->frame_back = 0;
+	data->frame_exchange = 1;
+	data->frame_front = 2;
+	data->frame_generation = 0;
+	data->fifo_head = 0;
+	data->fifo_tail = 0;
+	memset(data->frames, 0, sizeof(data->frames));
+}
+
+static inline uint8_t* shared_frame_pixels(uint8_t* frames, size_t frame_size, uint32_t slot)
+{
+	return frames + (size_t) slot * frame_size;
+}
+
+/* browser side: publish the frame written into frame_back and take over the
+ * parked slot for the next one */
+static inline void shared_frame_publish(shared_data_t* data)
+{
+	uint32_t back = data->frame_back;
+	data->frames[back].generation = ++data->frame_generation;
+	uint32_t parked = __atomic_exchange_n(&data->frame_exchange, back | SHARED_FRAME_FRESH,
+	                                      __ATOMIC_ACQ_REL);
+	data->frame_back = parked & SHARED_FRAME_SLOT_MASK;
+	shared_signal(&data->frame_seq, &data->frame_waiters);
+}
+
+/* plugin side: move the newest published frame into frame_front, returns
+ * false if nothing was published since the last call */
+static inline bool shared_frame_acquire(shared_data_t* data)
+{
+	if (!(__atomic_load_n(&data->frame_exchange, __ATOMIC_ACQUIRE) & SHARED_FRAME_FRESH))
+		return false;
+
+	uint32_t parked =
+	    __atomic_exchange_n(&data->frame_exchange, data->frame_front, __ATOMIC_ACQ_REL);
+	data->frame_front = parked & SHARED_FRAME_SLOT_MASK;
+	return true;
+}
+
+/* browser side, fifo mode: returns false while the plugin still holds every
+ * slot, else the slot to write the next frame into */
+static inline bool shared_fifo_writable(shared_data_t* data, uint32_t* slot)
+{
+	uint64_t head = data->fifo_head;
+	if (head - __atomic_load_n(&data->fifo_tail, __ATOMIC_ACQUIRE) >= SHARED_FRAME_SLOTS)
+		return false;
+	*slot = head % SHARED_FRAME_SLOTS;
+	return true;
+}
+
+static inline void shared_fifo_push(shared_data_t* data)
+{
+	uint64_t head = data->fifo_head;
+	data->frames[head % SHARED_FRAME_SLOTS].generation = ++data->frame_generation;
+	__atomic_store_n(&data->fifo_head, head + 1, __ATOMIC_RELEASE);
+	shared_signal(&data->frame_seq, &data->frame_waiters);
+}
+
+/* plugin side, fifo mode: the oldest frame not taken yet */
+static inline bool shared_fifo_readable(shared_data_t* data, uint32_t* slot)
+{
+	uint64_t tail = data->fifo_tail;
+	if (__atomic_load_n(&data->fifo_head, __ATOMIC_ACQUIRE) == tail)
+		return false;
+	*slot = tail % SHARED_FRAME_SLOTS;
+	return true;
+}
+
+static inline void shared_fifo_pop(shared_data_t* data)
+{
+	__atomic_store_n(&data->fifo_tail, data->fifo_tail + 1, __ATOMIC_RELEASE);
+	shared_signal(&data->fifo_seq, &data->fifo_waiters);
+}
+
+static inline void shared_ring_copy_in(shared_ring_t* ring, uint64_t pos, const void* src,
+                                       size_t size)
+{
+	size_t offset = pos % SHARED_RING_SIZE;
+	size_t first = size < SHARED_RING_SIZE - offset ? size : SHARED_RING_SIZE - offset;
+	memcpy(ring->data + offset, src, first);
+	memcpy(ring->data, (const uint8_t*) src + first, size - first);
+}
+
+static inline void shared_ring_copy_out(const shared_ring_t* ring, uint64_t pos, void* dst,
+                                        size_t size)
+{
+	size_t offset = pos % SHARED_RING_SIZE;
+	size_t first = size < SHARED_RING_SIZE - offset ? size : SHARED_RING_SIZE - offset;
+	memcpy(dst, ring->data + offset, first);
+	memcpy((uint8_t*) dst + first, ring->data, size - first);
+}
+
+/* a queued record is READY until the consumer takes it. The producer may
+ * still rewrite the payload of a READY record, marking it WRITING meanwhile,
+ * which is how consecutive input events get merged. */
+#define SHARED_RECORD_READY 0
+#define SHARED_RECORD_WRITING 1
+#define SHARED_RECORD_TAKEN 2
+#define SHARED_RECORD_HEADER (2 * sizeof(uint32_t))
+
+/* records start on 8 bytes, so their header never wraps around */
+static inline uint32_t* shared_ring_record_state(shared_ring_t* ring, uint64_t pos)
+{
+	return (uint32_t*) (ring->data + pos % SHARED_RING_SIZE + sizeof(uint32_t));
+}
+
+/* producer side: queue a message, returns false without waiting if the
+ * consumer has not made room for it yet. pos, if given, receives the
+ * position to pass to shared_ring_replace. */
+static inline bool shared_ring_push(shared_ring_t* ring, const void* msg, uint32_t size,
+                                    uint64_t* pos)
+{
+	uint64_t head = ring->head;
+	uint64_t record = SHARED_ROUND(SHARED_RECORD_HEADER + size, 8);
+	if (record > SHARED_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)))
+		return false;
+
+	uint32_t header[2] = {size, SHARED_RECORD_READY};
+	shared_ring_copy_in(ring, head, header, sizeof(header));
+	shared_ring_copy_in(ring, head + SHARED_RECORD_HEADER, msg, size);
+	__atomic_store_n(&ring->head, head + record, __ATOMIC_RELEASE);
+	if (pos)
+		*pos = head;
+	return true;
+}
+
+/* producer side: overwrite the message pushed at pos with one of the same
+ * size, returns false if the consumer already took it */
+static inline bool shared_ring_replace(shared_ring_t* ring, uint64_t pos, const void* msg,
+                                       uint32_t size)
+{
+	uint32_t* state = shared_ring_record_state(ring, pos);
+	uint32_t expected = SHARED_RECORD_READY;
+	if (!__atomic_compare_exchange_n(state, &expected, SHARED_RECORD_WRITING, false,
+	                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return false;
+
+	uint32_t old_size;
+	shared_ring_copy_out(ring, pos, &old_size, sizeof(old_size));
+	if (old_size == size)
+		shared_ring_copy_in(ring, pos + SHARED_RECORD_HEADER, msg, size);
+	__atomic_store_n(state, SHARED_RECORD_READY, __ATOMIC_RELEASE);
+	return old_size == size;
+}
+
+/* producer side, after a push: whether the consumer went to sleep and has to
+ * be woken through the doorbell */
+static inline bool shared_ring_needs_doorbell(shared_ring_t* ring)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED);
+}
+
+/* drop everything queued, only while no consumer is attached */
+static inline void shared_ring_clear(shared_ring_t* ring)
+{
+	__atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_RELAXED),
+	                 __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static inline bool shared_ring_empty(shared_ring_t* ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+/* consumer side: copy the oldest message into msg, returns its size or 0 if
+ * the ring is empty. Messages longer than max are truncated. */
+static inline uint32_t shared_ring_pop(shared_ring_t* ring, void* msg, uint32_t max)
+{
+	uint64_t tail = ring->tail;
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+		return 0;
+
+	/* the producer only ever holds a record for a few bytes of copying */
+	uint32_t* state = shared_ring_record_state(ring, tail);
+	uint32_t expected = SHARED_RECORD_READY;
+	while (!__atomic_compare_exchange_n(state, &expected, SHARED_RECORD_TAKEN, false,
+	                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		expected = SHARED_RECORD_READY;
+
+	uint32_t size;
+	shared_ring_copy_out(ring, tail, &size, sizeof(size));
+	shared_ring_copy_out(ring, tail + SHARED_RECORD_HEADER, msg, size < max ? size : max);
+	__atomic_store_n(&ring->tail, tail + SHARED_ROUND(SHARED_RECORD_HEADER + size, 8),
+	                 __ATOMIC_RELEASE);
+	return size;
+}
@@ -0,0 +1,65 @@
+/*
+Copyright (C) 2017 by Azat Khasanshin <azat.khasanshin@gmail.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+
+#include "messages.h"
+
+/* checks that browser_coalesce_message only merges what the page could not
+ * tell apart */
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                                \
+	do {                                                                                       \
+		if (!(cond)) {                                                                     \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);                 \
+			failures++;                                                                \
+		}                                                                                  \
+	} while (0)
+
+static browser_message_t mouse_move(int32_t x, int32_t y, uint32_t modifiers, bool leave)
+{
+	uint8_t buf[MAX_MESSAGE_SIZE];
+	browser_message_t msg;
+	size_t size = browser_encode_mouse_move(buf, sizeof(buf), x, y, modifiers, leave);
+	CHECK(size > 0 && browser_decode_message(buf, size, &msg));
+	return msg;
+}
+
+int main(void)
+{
+	browser_message_t prev = mouse_move(1, 2, 0, false);
+	browser_message_t next = mouse_move(3, 4, 0, false);
+	CHECK(browser_coalesce_message(&prev, &next));
+	CHECK(prev.mouse_move.x == 3 && prev.mouse_move.y == 4);
+
+	/* leaving and coming back in must both reach the page */
+	prev = mouse_move(1, 2, 0, true);
+	next = mouse_move(3, 4, 0, false);
+	CHECK(!browser_coalesce_message(&prev, &next));
+	CHECK(prev.mouse_move.mouse_leave && prev.mouse_move.x == 1);
+
+	prev = mouse_move(1, 2, 0, false);
+	next = mouse_move(3, 4, 0, true);
+	CHECK(!browser_coalesce_message(&prev, &next));
+
+	prev = mouse_move(1, 2, 0, false);
+	next = mouse_move(3, 4, 1, false);
+	CHECK(!browser_coalesce_message(&prev, &next));
+
+	return failures ? 1 : 0;
+}